@@ -0,0 +1,551 @@
+//
+//   Remote flashing agent
+//
+//  The agent runs on a small host next to the modem and exports its port
+//  over TCP; the firmware is parsed by the controller, which connects with
+//
+//    -p agent:<host>:<port>
+//
+//  The controller sends ready HDLC frames, the agent writes each one to the
+//  port and returns the raw reply frame. Block frames are pipelined: the
+//  controller keeps up to agent_window frames in flight, so the network
+//  round trip is paid once per window instead of once per block. Frames are
+//  zlib-compressed when this makes them shorter. The agent holds one frame
+//  at a time and never sees the firmware image.
+//
+//  The agent listens on the loopback address unless a host is given: a
+//  controller can write anything to the modem. To listen on a network the
+//  agent needs a shared token in BALONG_AGENT_TOKEN, the controller sends
+//  its own BALONG_AGENT_TOKEN in the first message of the connection.
+//
+//  Messages in both directions: type (1 byte), payload length (4 bytes,
+//  little-endian), payload.
+//
+//   controller -> agent
+//    'A'  token, the first message of the connection, may be empty
+//    'F'  frame: seq (4), timeout ms (4), flags (1), [raw length (4)], data
+//         flags: 1 - pipelined, skipped after a failed pipelined frame
+//                2 - data is zlib-compressed
+//    'W'  raw bytes for the port (AT commands)
+//
+//   agent -> controller
+//    'H'  hello: port name
+//    'E'  error text, the agent closes the connection
+//    'R'  reply to frame: seq (4), raw reply frame, empty - no reply
+//    'D'  raw bytes from the port received outside of frame exchanges
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "zlib.h"
+#include "hdlcio.h"
+#include "transport.h"
+#include "util.h"
+#include "agent.h"
+
+// frames the controller sends ahead of the replies
+#define agent_window 16
+
+// largest message payload
+#define agent_maxmsg 20000
+
+// environment variable with the shared token
+#define agent_token_env "BALONG_AGENT_TOKEN"
+
+// how much longer than the reply timeout the controller waits for a reply
+// that has to cross the network and the frames queued before it
+#define agent_slack 10000
+
+// message header length
+#define hdr_len 5
+
+//****************************************************
+//* Little-endian 32-bit fields
+//****************************************************
+static void put32(uint8_t* p, uint32_t v) {
+
+p[0]=v;
+p[1]=v>>8;
+p[2]=v>>16;
+p[3]=v>>24;
+}
+
+static uint32_t get32(uint8_t* p) {
+
+return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+//****************************************************
+//* Send message
+//****************************************************
+static int send_msg(int fd, uint8_t type, uint8_t* hdr, int hlen, uint8_t* data, int len) {
+
+uint8_t buf[hdr_len+13+agent_maxmsg];
+struct pollfd pfd;
+int res,pos=0,total;
+
+buf[0]=type;
+put32(buf+1,hlen+len);
+memcpy(buf+hdr_len,hdr,hlen);
+memcpy(buf+hdr_len+hlen,data,len);
+total=hdr_len+hlen+len;
+pfd.fd=fd;
+pfd.events=POLLOUT;
+while (pos<total) {
+  res=send(fd,buf+pos,total-pos,MSG_NOSIGNAL);
+  if (res == -1) {
+    if ((errno != EAGAIN) && (errno != EINTR)) return 0;
+    if (poll(&pfd,1,5000) <= 0) return 0;
+    continue;
+  }
+  pos+=res;
+}
+return 1;
+}
+
+//****************************************************
+//* Receive exactly len bytes within timeout ms
+//****************************************************
+static int recv_all(int fd, uint8_t* buf, int len, int timeout) {
+
+struct pollfd pfd;
+int res,pos=0;
+uint64_t deadline=now_us()+timeout*1000LL;
+int64_t left;
+
+pfd.fd=fd;
+pfd.events=POLLIN;
+while (pos<len) {
+  left=((int64_t)(deadline-now_us()))/1000;
+  if ((left<0) || (poll(&pfd,1,left) <= 0)) return 0;
+  res=recv(fd,buf+pos,len-pos,MSG_DONTWAIT);
+  if (res == 0) return 0;   // connection closed
+  if (res<0) {
+    if ((errno == EAGAIN) || (errno == EINTR)) continue;
+    return 0;
+  }
+  pos+=res;
+}
+return 1;
+}
+
+//****************************************************
+//* Receive message
+//*
+//*  buf - payload buffer, agent_maxmsg bytes
+//*
+//* returns payload length, -1 - timeout or connection lost
+//****************************************************
+static int recv_msg(int fd, uint8_t* type, uint8_t* buf, int timeout) {
+
+uint8_t hdr[hdr_len];
+uint32_t len;
+
+if (!recv_all(fd,hdr,hdr_len,timeout)) return -1;
+*type=hdr[0];
+len=get32(hdr+1);
+if (len>agent_maxmsg) return -1;
+// the rest of the message is already on its way
+if (!recv_all(fd,buf,len,agent_slack)) return -1;
+return len;
+}
+
+//----------------------------------------------------
+//  Controller side - transport backend
+//----------------------------------------------------
+
+struct actx {
+  uint32_t sent;       // seq of the last frame sent
+  uint32_t acked;      // seq of the last frame whose reply was taken
+  uint8_t msg[agent_maxmsg];
+  int mpos,mlen;       // unread part of the current message
+  int cut;             // the current reply has no end of frame
+  uint8_t zbuf[agent_maxmsg];
+};
+
+//****************************************************
+//* Write: frames go as 'F', anything else as 'W'
+//****************************************************
+static int agent_write(struct transport* t, void* buf, int len) {
+
+struct actx* a=t->ctx;
+uint8_t hdr[13];
+uLongf zlen;
+int hlen;
+
+if ((len == 0) || (((uint8_t*)buf)[0] != 0x7e)) return send_msg(t->fd,'W',0,0,buf,len);
+
+a->sent++;
+put32(hdr,a->sent);
+put32(hdr+4,t->timeout);
+// a frame sent while others wait for replies belongs to a pipelined run
+hdr[8]=(t->inflight != 0)?1:0;
+hlen=9;
+zlen=sizeof(a->zbuf);
+if ((len>256) && (compress2(a->zbuf,&zlen,buf,len,Z_BEST_SPEED) == Z_OK) && (zlen+4<len)) {
+  hdr[8]|=2;
+  put32(hdr+9,len);
+  hlen=13;
+  buf=a->zbuf;
+  len=zlen;
+}
+return send_msg(t->fd,'F',hdr,hlen,buf,len);
+}
+
+//****************************************************
+//* Read: the reply of the oldest frame, or port data
+//****************************************************
+static int agent_read(struct transport* t, void* buf, int len, int timeout) {
+
+struct actx* a=t->ctx;
+uint8_t type;
+int mlen,wait;
+
+while (a->mpos == a->mlen) {
+  if (a->cut) {
+    // reply ended without end of frame - the same as a timeout on the port
+    a->cut=0;
+    return 0;
+  }
+  wait=timeout;
+  if (a->sent != a->acked) wait+=agent_slack;
+  mlen=recv_msg(t->fd,&type,a->msg,wait);
+  if (mlen<0) return 0;
+  if (type == 'E') {
+    printf("\n! Agent: %.*s\n",mlen,a->msg);
+    return 0;
+  }
+  if (type == 'D') {
+    // port data is only wanted when no frame is waiting for a reply
+    if (a->sent != a->acked) continue;
+    a->mpos=0;
+    a->mlen=mlen;
+    continue;
+  }
+  if ((type != 'R') || (mlen<4)) continue;
+  if (get32(a->msg) != a->acked+1) continue;   // reply to a forgotten frame
+  a->acked++;
+  if (mlen == 4) return 0;   // frame timed out on the agent
+  a->mpos=4;
+  a->mlen=mlen;
+  a->cut=(a->msg[mlen-1] != 0x7e);
+}
+if (len>a->mlen-a->mpos) len=a->mlen-a->mpos;
+memcpy(buf,a->msg+a->mpos,len);
+a->mpos+=len;
+return len;
+}
+
+//****************************************************
+//* Flush: forget unread data and frames without replies
+//****************************************************
+static void agent_flush(struct transport* t) {
+
+struct actx* a=t->ctx;
+uint8_t type;
+
+a->mpos=a->mlen=0;
+a->cut=0;
+a->acked=a->sent;
+while (recv_msg(t->fd,&type,a->msg,0) >= 0);
+}
+
+static void agent_close(struct transport* t) {
+
+free(t->ctx);
+fd_close(t);
+}
+
+static struct tops agent_ops={agent_write,agent_read,agent_flush,agent_close};
+
+//****************************************************
+//* Connect to the agent
+//*
+//*  spec - <host>:<port>
+//****************************************************
+struct transport* agent_open(char* spec) {
+
+struct transport* t;
+struct actx* a;
+uint8_t type;
+int len;
+char* token;
+
+t=tcp_open(spec);
+if (t == 0) return 0;
+a=calloc(1,sizeof(struct actx));
+t->ops=&agent_ops;
+t->ctx=a;
+t->window=agent_window;
+
+token=getenv(agent_token_env);
+if (token == 0) token="";
+if (!send_msg(t->fd,'A',0,0,(uint8_t*)token,strlen(token))) {
+  printf("\n Agent %s does not respond",spec);
+  agent_close(t);
+  return 0;
+}
+len=recv_msg(t->fd,&type,a->msg,5000);
+if ((len<0) || ((type != 'H') && (type != 'E'))) {
+  printf("\n Agent %s does not respond",spec);
+  agent_close(t);
+  return 0;
+}
+if (type == 'E') {
+  printf("\n Agent %s: %.*s",spec,len,a->msg);
+  agent_close(t);
+  return 0;
+}
+printf("\n Agent %s, port %.*s",spec,len,a->msg);
+return t;
+}
+
+//----------------------------------------------------
+//  Agent side
+//----------------------------------------------------
+
+//****************************************************
+//* Read reply frame from the port, raw
+//*
+//* The frame ends with the first 7e after its first byte.
+//****************************************************
+static int read_frame(struct transport* port, uint8_t* buf, int size, int timeout) {
+
+int i,res,len=0;
+
+while (len<size) {
+  res=port->ops->read(port,buf+len,size-len,timeout);
+  if (res <= 0) break;
+  for (i=(len == 0)?1:len;i<len+res;i++) {
+    if (buf[i] == 0x7e) return i+1;
+  }
+  len+=res;
+}
+return len;
+}
+
+//****************************************************
+//* Serve one controller connection
+//****************************************************
+static void agent_session(int fd, struct transport* port) {
+
+uint8_t msg[agent_maxmsg];
+uint8_t frame[agent_maxmsg];
+uint8_t* data;
+uint8_t type,flags;
+struct pollfd pfd[2];
+uLongf flen;
+int len,dlen,failed=0;
+uint32_t timeout;
+uint32_t nframes=0,nskipped=0;
+uint64_t netbytes=0,portbytes=0;
+
+pfd[0].fd=fd;
+pfd[0].events=POLLIN;
+pfd[1].fd=port->fd;
+pfd[1].events=POLLIN;
+for (;;) {
+  if (poll(pfd,2,-1) <= 0) continue;
+  // port data outside of frame exchanges
+  if (pfd[1].revents != 0) {
+    len=(pfd[1].revents & POLLIN)?port->ops->read(port,frame,4096,0):0;
+    if (len>0) {
+      if (!send_msg(fd,'D',0,0,frame,len)) break;
+    }
+    else if (pfd[1].revents & (POLLHUP|POLLERR|POLLNVAL)) {
+      // port is gone, e.g. the modem re-enumerates after a reboot
+      send_msg(fd,'E',0,0,(uint8_t*)"modem port closed",17);
+      break;
+    }
+  }
+  if (!(pfd[0].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+  len=recv_msg(fd,&type,msg,agent_slack);
+  if (len<0) break;
+  netbytes+=hdr_len+len;
+
+  if (type == 'W') {
+    port->ops->write(port,msg,len);
+    portbytes+=len;
+    continue;
+  }
+  if ((type != 'F') || (len<9)) continue;
+
+  timeout=get32(msg+4);
+  flags=msg[8];
+  data=msg+9;
+  dlen=len-9;
+  if (!(flags & 1)) failed=0;   // a new run of frames
+  else if (failed) {
+    // the modem rejected an earlier block of this run - do not write the rest
+    nskipped++;
+    if (!send_msg(fd,'R',msg,4,0,0)) break;
+    continue;
+  }
+  if (flags & 2) {
+    flen=sizeof(frame);
+    if ((dlen<4) || (uncompress(frame,&flen,data+4,dlen-4) != Z_OK) || (flen != get32(data))) {
+      send_msg(fd,'E',0,0,(uint8_t*)"corrupted frame",15);
+      break;
+    }
+    data=frame;
+    dlen=flen;
+  }
+  port->ops->flush(port);
+  port->ops->write(port,data,dlen);
+  nframes++;
+  portbytes+=dlen;
+  len=read_frame(port,msg+4,sizeof(msg)-4,timeout);
+  if ((flags & 1) && ((len<2) || (msg[5] != 2))) failed=1;
+  if (!send_msg(fd,'R',msg,len+4,0,0)) break;
+}
+printf("\n Controller disconnected: %u frames, %u skipped, %llu bytes received, %llu bytes written to the port\n",
+       nframes,nskipped,(unsigned long long)netbytes,(unsigned long long)portbytes);
+}
+
+//****************************************************
+//* Controller address for messages
+//****************************************************
+static void peer_name(int fd, char* name, int size) {
+
+struct sockaddr_storage sa;
+socklen_t slen=sizeof(sa);
+char host[64],port[16];
+
+if ((getpeername(fd,(struct sockaddr*)&sa,&slen) != 0) ||
+    (getnameinfo((struct sockaddr*)&sa,slen,host,sizeof(host),port,sizeof(port),NI_NUMERICHOST|NI_NUMERICSERV) != 0)) {
+  snprintf(name,size,"?");
+  return;
+}
+snprintf(name,size,"%s:%s",host,port);
+}
+
+//****************************************************
+//* Listening address is the loopback one
+//****************************************************
+static int is_loopback(struct sockaddr* sa) {
+
+if (sa->sa_family == AF_INET) return (ntohl(((struct sockaddr_in*)sa)->sin_addr.s_addr)>>24) == 127;
+if (sa->sa_family == AF_INET6) return IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6*)sa)->sin6_addr);
+return 0;
+}
+
+//****************************************************
+//* Check the token in the first message of the controller
+//*
+//*  token - shared token, 0 - any token is accepted
+//****************************************************
+static int agent_auth(int fd, char* token) {
+
+uint8_t msg[agent_maxmsg];
+uint8_t type;
+int i,len,diff;
+
+len=recv_msg(fd,&type,msg,5000);
+if ((len<0) || (type != 'A')) return 0;
+if (token == 0) return 1;
+if (len != strlen(token)) return 0;
+// compare all bytes, the time does not tell how much of the token is right
+for (i=0,diff=0;i<len;i++) diff|=msg[i]^(uint8_t)token[i];
+return diff == 0;
+}
+
+//****************************************************
+//* Agent mode
+//*
+//*  addr - [<host>:]<port> to listen on, loopback without a host
+//*  devname - modem port, opened for each controller connection
+//****************************************************
+int run_agent(char* addr, char* devname) {
+
+struct addrinfo hints,*res;
+char host[256];
+char peer[100];
+char* sptr;
+char* service;
+char* token;
+int lfd,fd,on=1;
+struct transport* port;
+
+if (*devname == 0) {
+  printf("\n Agent mode needs the modem port, use -p\n");
+  return -1;
+}
+snprintf(host,sizeof(host),"%s",addr);
+sptr=strrchr(host,':');
+if (sptr != 0) {
+  *sptr=0;
+  service=sptr+1;
+}
+else {
+  // a remote controller can write anything to the modem - only on request
+  snprintf(host,sizeof(host),"127.0.0.1");
+  service=addr;
+}
+
+memset(&hints,0,sizeof(hints));
+hints.ai_family=AF_UNSPEC;
+hints.ai_socktype=SOCK_STREAM;
+hints.ai_flags=AI_PASSIVE;
+if (getaddrinfo(host,service,&hints,&res) != 0) {
+  printf("\n Invalid agent address %s\n",addr);
+  return -1;
+}
+token=getenv(agent_token_env);
+if ((token != 0) && (*token == 0)) token=0;
+if ((token == 0) && !is_loopback(res->ai_addr)) {
+  printf("\n Agent on %s accepts controllers from the network, set the shared token in %s\n",addr,agent_token_env);
+  freeaddrinfo(res);
+  return -1;
+}
+lfd=socket(res->ai_family,res->ai_socktype,res->ai_protocol);
+if (lfd != -1) setsockopt(lfd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+if ((lfd == -1) || (bind(lfd,res->ai_addr,res->ai_addrlen) != 0) || (listen(lfd,1) != 0)) {
+  printf("\n Cannot listen on %s\n",addr);
+  return -1;
+}
+freeaddrinfo(res);
+printf("\n Agent for port %s listening on %s:%s%s\n",devname,host,service,(token != 0)?", token required":"");
+fflush(stdout);
+
+for (;;) {
+  fd=accept(lfd,0,0);
+  if (fd == -1) continue;
+  setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+  fcntl(fd,F_SETFL,O_NONBLOCK);
+  peer_name(fd,peer,sizeof(peer));
+  if (!agent_auth(fd,token)) {
+    printf("\n Controller %s: wrong token, connection refused\n",peer);
+    send_msg(fd,'E',0,0,(uint8_t*)"wrong token",11);
+    close(fd);
+    continue;
+  }
+  // the port is opened per connection - the modem re-enumerates after a reboot
+  port=serial_open(devname);
+  if (port == 0) {
+    printf("\n Controller %s: port %s cannot be opened\n",peer,devname);
+    snprintf(host,sizeof(host),"port %s cannot be opened",devname);
+    send_msg(fd,'E',0,0,(uint8_t*)host,strlen(host));
+    close(fd);
+    continue;
+  }
+  printf("\n Controller %s connected",peer);
+  fflush(stdout);
+  send_msg(fd,'H',0,0,(uint8_t*)devname,strlen(devname));
+  agent_session(fd,port);
+  port->ops->close(port);
+  close(fd);
+  fflush(stdout);
+}
+return 0;
+}
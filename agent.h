@@ -0,0 +1 @@
+int run_agent(char* addr, char* devname);
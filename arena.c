@@ -0,0 +1,172 @@
+//
+//   Memory arena of the loaded firmware
+//
+//  Partition images and checksum blocks are carved from large chunks of
+//  address space instead of a malloc/free cascade per partition. The
+//  header pass of a firmware file reserves a chunk for the whole file
+//  (arena_reserve), allocations only move the top of the current chunk,
+//  and free_ptable releases everything with arena_release.
+//
+//  Chunks are reserved, not committed: pages are backed by memory when
+//  they are first touched, so the decompression headroom costs nothing
+//  until it is used. On Linux the chunks are 2 MB aligned and marked for
+//  transparent huge pages, so loading a large image takes far fewer page
+//  faults.
+//
+#include <stdio.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#else
+#include <windows.h>
+#include "printf.h"
+#endif
+
+#include "arena.h"
+
+// chunk granularity and alignment
+#define arena_align (2*1024*1024)
+
+// smallest chunk reserved on demand
+#define arena_min (64*1024*1024)
+
+// allocations are aligned to
+#define alloc_align 16
+
+struct achunk {
+  struct achunk* next;
+  uint8_t* base;       // aligned start of the chunk
+  uint64_t size;       // usable bytes
+  uint64_t top;        // allocated bytes
+  void* map;           // mapping to release
+  uint64_t maplen;
+#ifdef WIN32
+  uint64_t committed;  // committed bytes from base
+#endif
+};
+
+// current chunk first
+static struct achunk* chunks=0;
+
+//****************************************************
+//* Reserve a new chunk and make it current
+//****************************************************
+static void new_chunk(uint64_t size) {
+
+struct achunk* c;
+uint8_t* map;
+
+size=(size+arena_align-1)&~(uint64_t)(arena_align-1);
+c=calloc(1,sizeof(struct achunk));
+#ifndef WIN32
+// extra 2 MB to align the chunk for huge pages
+c->maplen=size+arena_align;
+map=mmap(0,c->maplen,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+if (map == MAP_FAILED) map=0;
+c->base=(uint8_t*)(((uintptr_t)map+arena_align-1)&~(uintptr_t)(arena_align-1));
+#ifdef MADV_HUGEPAGE
+if (map != 0) madvise(c->base,size,MADV_HUGEPAGE);
+#endif
+#else
+c->maplen=size;
+map=VirtualAlloc(0,size,MEM_RESERVE,PAGE_READWRITE);
+c->base=map;
+#endif
+if (map == 0) {
+  printf("\n! Memory allocation error, %llu MB of address space\n",(unsigned long long)(size>>20));
+  exit(1);
+}
+c->map=map;
+c->size=size;
+c->next=chunks;
+chunks=c;
+}
+
+//****************************************************
+//* Make sure the current chunk has size free bytes
+//*
+//* Called by the header pass with the size of the whole
+//* firmware file, so its partitions share one chunk.
+//****************************************************
+void arena_reserve(uint64_t size) {
+
+if ((chunks != 0) && (chunks->size-chunks->top >= size)) return;
+new_chunk((size>arena_min)?size:arena_min);
+}
+
+//****************************************************
+//* Free space at the top of the arena
+//*
+//* The space is not allocated: the next allocation
+//* starts at the returned address. Used as output buffer
+//* whose final size is not known in advance.
+//****************************************************
+void* arena_scratch(uint64_t size) {
+
+uint8_t* ptr;
+#ifdef WIN32
+uint64_t need;
+#endif
+
+arena_reserve(size);
+ptr=chunks->base+chunks->top;
+#ifdef WIN32
+need=(chunks->top+size+arena_align-1)&~(uint64_t)(arena_align-1);
+if (need>chunks->size) need=chunks->size;
+if (need>chunks->committed) {
+  if (VirtualAlloc(chunks->base+chunks->committed,need-chunks->committed,MEM_COMMIT,PAGE_READWRITE) == 0) {
+    printf("\n! Memory allocation error, %llu MB\n",(unsigned long long)(need>>20));
+    exit(1);
+  }
+  chunks->committed=need;
+}
+#endif
+return ptr;
+}
+
+//****************************************************
+//* Allocate from the arena
+//****************************************************
+void* arena_alloc(uint64_t size) {
+
+void* ptr;
+
+ptr=arena_scratch(size);
+chunks->top+=(size+alloc_align-1)&~(uint64_t)(alloc_align-1);
+return ptr;
+}
+
+//****************************************************
+//* Release the allocations from ptr to the top
+//*
+//* Only works inside the current chunk, otherwise the
+//* space stays allocated until arena_release.
+//****************************************************
+void arena_rewind(void* ptr) {
+
+uint8_t* p=ptr;
+
+if ((chunks == 0) || (p<chunks->base) || (p>chunks->base+chunks->top)) return;
+chunks->top=p-chunks->base;
+}
+
+//****************************************************
+//* Release the whole arena
+//****************************************************
+void arena_release() {
+
+struct achunk* c;
+
+while (chunks != 0) {
+  c=chunks;
+  chunks=c->next;
+#ifndef WIN32
+  munmap(c->map,c->maplen);
+#else
+  VirtualFree(c->map,0,MEM_RELEASE);
+#endif
+  free(c);
+}
+}
@@ -0,0 +1,7 @@
+// Memory arena of the loaded firmware
+
+void arena_reserve(uint64_t size);
+void* arena_scratch(uint64_t size);
+void* arena_alloc(uint64_t size);
+void arena_rewind(void* ptr);
+void arena_release();
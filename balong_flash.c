@@ -9,6 +9,7 @@
 #include <strings.h>
 #include <termios.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <arpa/inet.h>
 #else
 #include <windows.h>
@@ -22,6 +23,22 @@
 #include "flasher.h"
 #include "util.h"
 #include "signver.h"
+#include "journal.h"
+#include "history.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+#include "flightrec.h"
+#include "progress.h"
+#include "estimate.h"
+#include "pack.h"
+#include "imgscan.h"
+#ifndef WIN32
+#include "discover.h"
+#include "daemon.h"
+#include "schedule.h"
+#include "agent.h"
+#endif
 #include "zlib.h"
 
 // file structure error flag
@@ -38,34 +55,91 @@ int dload_id=-1;
 //***********************************************
 //* Partition table
 //***********************************************
-struct ptb_t ptable[120];
+struct ptb_t* ptable=0;  // grows with ptable_add()
 int npart=0; // number of partitions in the table
 
 
+//***********************************************
+//* Long options
+//***********************************************
+static struct option longopts[] = {
+  {"only", required_argument, 0, 'O'},
+  {"skip", required_argument, 0, 'X'},
+  {"incremental", required_argument, 0, 'I'},
+  {"full", no_argument, 0, 'F'},
+  {"discover", no_argument, 0, 'D'},
+  {"daemon", no_argument, 0, 'W'},
+  {"control", required_argument, 0, 'C'},
+  {"schedule", required_argument, 0, 'S'},
+  {"ports", required_argument, 0, 'P'},
+  {"parallel", required_argument, 0, 'N'},
+  {"health", required_argument, 0, 'H'},
+  {"stats", required_argument, 0, 'T'},
+  {"trace", required_argument, 0, 'R'},
+  {"capture", required_argument, 0, 'c'},
+  {"agent", required_argument, 0, 'A'},
+  {"flightrec", required_argument, 0, 'L'},
+  {"progress-fd", required_argument, 0, 'G'},
+  {"estimate", no_argument, 0, 'E'},
+  {"profiles", required_argument, 0, 'M'},
+  {"model", required_argument, 0, 'Y'},
+  {"pack", required_argument, 0, 'K'},
+  {"blocksize", required_argument, 0, 'B'},
+  {"compress", required_argument, 0, 'Z'},
+  {"image", required_argument, 0, 'Q'},
+  {0,0,0,0}
+};
+
 //@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
 
 int main(int argc, char* argv[]) {
 
 unsigned int opt;
-int res;
-FILE* in;
 char devname[50] = "";
 unsigned int  mflag=0,eflag=0,rflag=0,sflag=0,nflag=0,kflag=0,fflag=0;
-unsigned char fdir[40];   // directory for multi-file firmware
+int discflag=0,wflag=0,estflag=0;
+char* ctlpath=0;
+char* jobfile=0;
+char* portlist=0;
+char* healthfile=0;
+char* agentaddr=0;
+char* sptr;
+int parallel=0;
 
 // command line parsing
-while ((opt = getopt(argc, argv, "d:hp:mersng:kf")) != -1) {
+while ((opt = getopt_long(argc, argv, "d:hp:mersng:kfj:b:", longopts, 0)) != -1) {
   switch (opt) {
    case 'h': 
      
 printf("\n This utility is designed for flashing modems on the Balong V7 chipset\n\n\
-%s [options] <file name to load or directory name with files>\n\n\
+%s [options] <file names to load or directory names with files>\n\n\
+ Several files (directories with -n) are flashed one after another in a single session\n\n\
  The following options are allowed:\n\n"
 #ifndef WIN32
-"-p <tty> - serial port for communication with the bootloader (default /dev/ttyUSB0)\n"
+"-p <tty> - serial port for communication with the bootloader\n"
+"  if -p option is not specified, the first download port found in sysfs is used, else /dev/ttyUSB0\n"
+"  -p replay:<file>[@<speed>] - play back a session recorded with --capture,\n"
+"  recorded delays are divided by <speed>, @0 - no delays\n"
+"  -p tcp:<host>:<port> - modem port exported over TCP in raw mode (e.g. ser2net)\n"
+"  -p pty:[<link>] - pseudo-terminal for a modem emulator, <link> - symlink to its slave side\n"
+"  -p agent:<host>:<port> - modem port of a remote --agent, block frames are pipelined\n"
+"--agent [<host>:]<port> - serve the -p port to a remote controller over TCP; anyone who connects\n"
+"                         can write to the modem: without <host> only 127.0.0.1 is served, other\n"
+"                         hosts need a shared token in BALONG_AGENT_TOKEN on both sides\n"
+"--discover - probe all download ports at once and print JSON inventory\n"
+"--daemon - load the firmware once and flash every new download port that appears,\n"
+"  session output of each device goes to <tty>.log\n"
+"--control <path> - daemon control socket (commands: load <files>, status, quit)\n"
+"--schedule <file> - flash station mode, each line of <file> lists the firmware for one device\n"
+"--ports <list> - station ports, device names or USB paths (e.g. usb:1-3.2,/dev/ttyUSB4),\n"
+"  all download ports found in sysfs are used by default\n"
+"--parallel <n> - maximum number of devices flashed at the same time\n"
+"--health <file> - keep per-port success rate and speed across runs\n"
 #else
 "-p # - serial port number for communication with the bootloader (e.g., -p8)\n"
 "  if -p option is not specified, automatic port detection is performed\n"
+"  -p replay:<file>[@<speed>] - play back a session recorded with --capture,\n"
+"  recorded delays are divided by <speed>, @0 - no delays\n"
 #endif
 "-n       - multi-file flashing mode from the specified directory\n\
 -g#      - set digital signature mode\n\
@@ -78,6 +152,33 @@ printf("\n This utility is designed for flashing modems on the Balong V7 chipset
 -r       - force reboot modem without flashing partitions\n\
 -f       - flash even if CRC errors exist in the source file\n\
 -d#      - set firmware type (DLOAD_ID, 0..7), -dl - list of types\n\
+-b <size> - data block size per command (up to 8192, default 4096),\n\
+  -b auto - choose the fastest size accepted by the bootloader on the first partition\n\
+-j <file> - session journal, an interrupted flashing resumes from the failed partition\n\
+--only <list> - process only the listed partitions, names or hex codes (e.g. --only WEBUI,APP)\n\
+--skip <list> - do not process the listed partitions\n\
+  unselected partitions are not loaded; use -g if the signed partition is excluded\n\
+--incremental <file> - skip partitions unchanged since the last flashing of this device,\n\
+  per-device partition hashes are kept in <file>\n\
+--full   - with --incremental: write all partitions, only update the hashes\n\
+--stats <file> - write command latency histograms and transfer counters as JSON\n\
+  at the end of the run (on Linux also on SIGUSR1)\n\
+--trace <file> - write session timeline in Chrome trace format (chrome://tracing, Perfetto)\n\
+--capture <file> - record all bytes written to and read from the port with timestamps\n\
+--flightrec <file> - keep the last protocol events in memory and append them to <file>\n\
+  when the session fails or the program crashes\n\
+--progress-fd <n> - write flashing progress as newline-delimited JSON to descriptor <n>\n\
+--estimate - print wire bytes after HDLC escaping and predicted flashing time per partition\n\
+--profiles <file> - link profiles per device model, updated after every completed session\n\
+--model <id> - device model whose profile --estimate uses\n\
+--pack <out.bin> - build firmware file <out.bin> from the directory of partition files\n\
+  (raw images of -e or .fw files of -s), the firmware type is set with -d\n\
+--blocksize <n> - with --pack: checksum block size of the partitions\n"
+#ifndef WIN32
+"--compress <list> - with --pack: store the listed partitions zlib compressed\n"
+#endif
+"--image <n> - load image <n> of a file with several firmware images (EXE updaters),\n\
+  the images found are listed with their offsets\n\
 \n",argv[0]);
     return 0;
 
@@ -121,11 +222,149 @@ printf("\n This utility is designed for flashing modems on the Balong V7 chipset
      dparm(optarg);
      break;
      
+   case 'j':
+     jname=optarg;
+     break;
+     
+   case 'b':
+     if (strcmp(optarg,"auto") == 0) fblock_auto=1;
+     else {
+       fblock=atoi(optarg);
+       if ((fblock<256) || (fblock>fblock_max)) {
+         printf("\n Incorrect -b key value\n\n");
+         return -1;
+       }  
+     }  
+     break;
+     
+   case 'O':
+     if (part_filter(optarg,0) != 0) return -1;
+     break;
+     
+   case 'X':
+     if (part_filter(optarg,1) != 0) return -1;
+     break;
+     
+   case 'I':
+     hname=optarg;
+     break;
+     
+   case 'F':
+     hfull=1;
+     break;
+     
+   case 'D':
+     discflag=1;
+     break;
+     
+   case 'W':
+     wflag=1;
+     break;
+     
+   case 'C':
+     ctlpath=optarg;
+     break;
+     
+   case 'S':
+     jobfile=optarg;
+     break;
+     
+   case 'P':
+     portlist=optarg;
+     break;
+     
+   case 'N':
+     parallel=atoi(optarg);
+     break;
+     
+   case 'H':
+     healthfile=optarg;
+     break;
+     
+   case 'T':
+     sname=optarg;
+     break;
+     
+   case 'R':
+     tname=optarg;
+     break;
+     
+   case 'c':
+     capname=optarg;
+     break;
+     
+   case 'A':
+     agentaddr=optarg;
+     break;
+     
+   case 'L':
+     frname=optarg;
+     break;
+     
+   case 'G':
+     progress_fd=atoi(optarg);
+     break;
+     
+   case 'E':
+     estflag=1;
+     break;
+     
+   case 'M':
+     profname=optarg;
+     break;
+     
+   case 'Y':
+     modelname=optarg;
+     break;
+     
+   case 'K':
+     packname=optarg;
+     break;
+     
+   case 'B':
+     pack_blocksize=strtoul(optarg,&sptr,0);
+     // power of two the checksum block table can be built for
+     if ((*sptr != 0) || (optarg[0] == '-') || (pack_blocksize<512) || (pack_blocksize>1048576) ||
+         ((pack_blocksize&(pack_blocksize-1)) != 0)) {
+       printf("\n Invalid checksum block size %s, a power of two from 512 to 1048576 is expected\n",optarg);
+       return -1;
+     }
+     break;
+     
+   case 'Z':
+#ifndef WIN32
+     pack_zlist=optarg;
+     break;
+#else
+     // the Windows build has only the inflate side of zlib
+     printf("\n Option --compress is not supported in the Windows version\n");
+     return -1;
+#endif
+     
+   case 'Q':
+     image_sel=atoi(optarg);
+     if (image_sel<0) {
+       printf("\n Invalid image number %s\n",optarg);
+       return -1;
+     }
+     break;
+     
    case '?':
    case ':':  
      return -1;
   }
 }  
+stats_init();
+trace_init();
+capture_init();
+fr_init();
+progress_init();
+
+#ifndef WIN32
+// port inventory - pure JSON on stdout
+if (discflag) return discover_ports();
+#endif
+
 printf("\n Program for flashing Balong chipset devices, V3.0.%i, (c) forth32, 2015, GNU GPLv3",BUILDNO);
 #ifdef WIN32
 printf("\n Port for Windows 32bit  (c) rust3028, 2016");
@@ -148,6 +387,56 @@ if (nflag&(eflag|sflag|mflag)) {
 }  
 
 
+//------- Firmware packing mode
+if (packname != 0) {
+  if ((mflag|eflag|sflag|nflag|rflag) || (optind != argc-1)) {
+    printf("\n Option --pack takes one directory with partition files and is incompatible with other modes\n");
+    return -1;
+  }  
+  return pack_fw(argv[optind]);
+}
+
+#ifndef WIN32
+//------- Remote agent mode
+if (agentaddr != 0) {
+  if ((mflag|eflag|sflag|rflag|wflag) || (jobfile != 0) || (optind<argc)) {
+    printf("\n Option --agent does not take firmware files and is incompatible with other modes\n");
+    return -1;
+  }  
+  return run_agent(agentaddr,devname);
+}
+
+//------- Hotplug daemon mode
+if (wflag) {
+  if ((mflag|eflag|sflag|rflag) || (jobfile != 0)) {
+    printf("\n Option --daemon is incompatible with -m, -e, -s, -r and --schedule options\n");
+    return -1;
+  }  
+  if ((jname != 0) || (hname != 0) || (tname != 0)) {
+    printf("\n Options -j, --incremental and --trace are not supported in daemon mode\n");
+    return -1;
+  }  
+  if (optind>=argc) {
+    printf("\n - Firmware for daemon mode not specified\n");
+    return -1;
+  }  
+  return run_daemon(argv+optind,argc-optind,nflag,fflag,ctlpath,!kflag);
+}
+
+//------- Flash station mode
+if (jobfile != 0) {
+  if (mflag|eflag|sflag|rflag) {
+    printf("\n Option --schedule is incompatible with -m, -e, -s and -r options\n");
+    return -1;
+  }  
+  if ((jname != 0) || (hname != 0) || (tname != 0)) {
+    printf("\n Options -j, --incremental and --trace are not supported in flash station mode\n");
+    return -1;
+  }  
+  return run_schedule(jobfile,portlist,parallel,healthfile,nflag,fflag,!kflag);
+}
+#endif
+
 // ------  reboot without specifying a file
 //--------------------------------------------
 if ((optind>=argc)&rflag) goto sio; 
@@ -163,27 +452,8 @@ if (optind>=argc) {
   return -1;
 }  
 
-if (nflag) 
-  // for -n - just copy the prefix
-  strncpy(fdir,argv[optind],39);
-else {
-  // for single-file operations
-in=fopen(argv[optind],"rb");
-if (in == 0) {
-  printf("\n Error opening %s",argv[optind]);
-  return -1;
-}
-}
-
-
-// Search for partitions inside the file
-if (!nflag) {
-  findparts(in);
-  show_fw_info();
-}  
-
-// Search for firmware files in the specified directory
-else findfiles(fdir);
+// all files are loaded into one partition table and flashed in one session
+if (load_files(argv+optind,argc-optind,nflag) == -1) return -1;
   
 //------ Firmware file map display mode
 if (mflag) show_file_map();
@@ -194,6 +464,9 @@ if (!fflag && errflag) {
     return -1; 
 }
 
+//------- Flash time estimate mode
+if (estflag) return show_estimate();
+
 //------- Firmware file split mode
 if (eflag|sflag) {
   fwsplit(sflag);
@@ -204,52 +477,5 @@ if (eflag|sflag) {
 sio:
 //--------- Main mode - firmware writing
 //--------------------------------------------
-
-// SIO setup
-open_port(devname);
-
-// Determine port mode and dload protocol version
-
-res=dloadversion();
-if (res == -1) return -2;
-if (res == 0) {
-  printf("\n Modem is already in HDLC mode");
-  goto hdlc;
-}
-
-// If necessary, send digital signature command
-if (gflag != -1) send_signver();
-
-// Enter HDLC mode
-
-usleep(100000);
-enter_hdlc();
-
-// Entered HDLC
-//------------------------------
-hdlc:
-
-// get protocol version and device identifier
-protocol_version();
-dev_ident();
-
-
-printf("\n----------------------------------------------------\n");
-
-if ((optind>=argc)&rflag) {
-  // reboot without specifying a file
-  restart_modem();
-  exit(0);
-}  
-
-// Write all flash
-flash_all();
-printf("\n");
-
-port_timeout(1);
-
-// exit HDLC mode and reboot
-if (rflag || !kflag) restart_modem();
-// exit HDLC without reboot
-else leave_hdlc();
+return flash_session(devname,rflag || !kflag,(optind>=argc)&rflag);
 } 
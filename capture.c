@@ -0,0 +1,353 @@
+//
+//   Wire-level capture and replay of modem sessions
+//
+//  Capture file format: 8-byte signature "BFCAP01\n", then records
+//
+//    type      1 byte   'W' - written to the port, 'R' - read from the port,
+//                       'T' - read returned no data (timeout)
+//    delta     varint   microseconds since the previous record
+//    length    varint   data length
+//    data
+//
+//  Varints are little-endian base-128 (7 bits per byte, high bit - more
+//  bytes follow). Reads following each other within rmerge_us are merged
+//  into one record, so byte-by-byte reply parsing does not cost a record
+//  header per byte.
+//
+//  Replay is a transport backend (-p replay:<file>[@<speed>]): writes of
+//  the tool are matched against the recorded writes, and the recorded
+//  replies are returned with their recorded delay after the command divided
+//  by the speed factor. With speed 0 there are no delays and timeouts return
+//  at once, so framing and parsing can be benchmarked without a port.
+//
+#include <stdio.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#include "printf.h"
+#endif
+
+#include "hdlcio.h"
+#include "transport.h"
+#include "util.h"
+#include "capture.h"
+
+// capture file name, 0 - capture disabled
+char* capname=0;
+
+static char capsign[8]="BFCAP01\n";
+
+// reads closer than this are merged into one record, us
+#define rmerge_us 100
+
+static FILE* cfile=0;
+static uint64_t clast;      // time of the previous record
+
+// read record being collected
+static uint8_t* rbuf=0;
+static uint32_t rlen=0,rsize=0;
+static uint64_t rstart,rlast;
+
+//****************************************************
+//* Write varint
+//****************************************************
+static void put_varint(uint64_t v) {
+
+do {
+  fputc((v>0x7f)?((v&0x7f)|0x80):v,cfile);
+  v>>=7;
+} while (v != 0);
+}
+
+//****************************************************
+//* Write record
+//****************************************************
+static void put_record(uint8_t type, uint64_t t, uint8_t* buf, uint32_t len) {
+
+fputc(type,cfile);
+put_varint(t-clast);
+put_varint(len);
+if (len != 0) fwrite(buf,1,len,cfile);
+clast=t;
+}
+
+//****************************************************
+//* Write collected read record
+//****************************************************
+static void flush_reads() {
+
+if (rlen == 0) return;
+put_record('R',rstart,rbuf,rlen);
+rlen=0;
+}
+
+//****************************************************
+//* Account port data transfer
+//*
+//*  type - 'W', 'R' or 'T'
+//****************************************************
+void capture_data(uint8_t type, void* buf, int len) {
+
+uint64_t t;
+
+if (cfile == 0) return;
+t=now_us();
+if (type == 'R') {
+  if (len <= 0) return;
+  if ((rlen != 0) && (t-rlast>rmerge_us)) flush_reads();
+  if (rlen == 0) rstart=t;
+  if (rlen+len>rsize) {
+    rsize=rlen+len+4096;
+    rbuf=realloc(rbuf,rsize);
+  }
+  memcpy(rbuf+rlen,buf,len);
+  rlen+=len;
+  rlast=t;
+  return;
+}
+flush_reads();
+put_record(type,t,buf,len);
+}
+
+//****************************************************
+//* Close capture file
+//****************************************************
+static void capture_close() {
+
+flush_reads();
+fclose(cfile);
+cfile=0;
+}
+
+//****************************************************
+//* Open capture file
+//****************************************************
+void capture_init() {
+
+if (capname == 0) return;
+cfile=fopen(capname,"wb");
+if (cfile == 0) {
+  printf("\n Capture file %s cannot be created\n",capname);
+  exit(-1);
+}
+fwrite(capsign,1,sizeof(capsign),cfile);
+clast=now_us();
+atexit(capture_close);
+}
+
+//----------------------------------------------------
+//  Replay backend
+//----------------------------------------------------
+
+struct crec {
+  uint8_t type;
+  uint64_t t;      // time from the beginning of the capture, us
+  uint32_t len;
+  uint8_t* data;
+};
+
+static struct crec* recs=0;
+static int nrecs=0;
+static double rspeed;
+
+// replay position
+static int rcur=0;          // current record
+static uint32_t roff=0;     // position inside the current record
+static uint64_t rbase=0;    // time of the last command in the capture
+static uint64_t hbase=0;    // time the tool wrote it
+static int diverged=0;
+
+//****************************************************
+//* Read varint from buffer
+//****************************************************
+static int get_varint(uint8_t** ptr, uint8_t* end, uint64_t* v) {
+
+int shift=0;
+
+*v=0;
+while (*ptr<end) {
+  *v|=(uint64_t)(**ptr&0x7f)<<shift;
+  shift+=7;
+  if ((*(*ptr)++&0x80) == 0) return 1;
+}
+return 0;
+}
+
+//****************************************************
+//* Load capture file into memory
+//****************************************************
+static int replay_load(char* fname) {
+
+FILE* in;
+uint8_t* fbuf;
+uint8_t *ptr,*end;
+long fsize;
+uint64_t t=0,delta,len;
+
+in=fopen(fname,"rb");
+if (in == 0) {
+  printf("\n Capture file %s cannot be opened",fname);
+  return 0;
+}
+fseek(in,0,SEEK_END);
+fsize=ftell(in);
+fseek(in,0,SEEK_SET);
+fbuf=malloc(fsize);
+if (fread(fbuf,1,fsize,in) != fsize) fsize=0;
+fclose(in);
+if ((fsize<sizeof(capsign)) || (memcmp(fbuf,capsign,sizeof(capsign)) != 0)) {
+  printf("\n %s is not a capture file",fname);
+  return 0;
+}
+ptr=fbuf+sizeof(capsign);
+end=fbuf+fsize;
+while (ptr<end) {
+  recs=realloc(recs,(nrecs+1)*sizeof(struct crec));
+  recs[nrecs].type=*ptr++;
+  if (!get_varint(&ptr,end,&delta) || !get_varint(&ptr,end,&len) || (len>end-ptr)) {
+    printf("\n! Capture file %s is truncated, %i records used",fname,nrecs);
+    break;
+  }
+  t+=delta;
+  recs[nrecs].t=t;
+  recs[nrecs].len=len;
+  recs[nrecs].data=ptr;
+  ptr+=len;
+  nrecs++;
+}
+// fbuf stays allocated - records point into it
+return 1;
+}
+
+//****************************************************
+//* Sleep for a recorded interval scaled by the speed
+//****************************************************
+static void replay_sleep(uint64_t us) {
+
+if ((rspeed == 0) || (us == 0)) return;
+us=(uint64_t)(us/rspeed);
+if (us >= 1000) usleep(us);
+}
+
+//****************************************************
+//* Tool writes - consume the recorded writes
+//*
+//* Replies recorded but not read before this write were
+//* discarded by the tool in the capture as well.
+//****************************************************
+static int replay_write(struct transport* t, void* buf, int len) {
+
+uint8_t* data=buf;
+uint32_t n;
+
+while ((len>0) && (rcur<nrecs)) {
+  if (recs[rcur].type != 'W') {
+    rcur++;
+    roff=0;
+    continue;
+  }
+  n=recs[rcur].len-roff;
+  if (n>len) n=len;
+  if (!diverged && (memcmp(data,recs[rcur].data+roff,n) != 0)) {
+    printf("\n! Replay: written data differs from the capture, record %i\n",rcur);
+    diverged=1;
+  }
+  data+=n;
+  len-=n;
+  roff+=n;
+  rbase=recs[rcur].t;
+  if (roff == recs[rcur].len) {
+    rcur++;
+    roff=0;
+  }
+}
+hbase=now_us();
+return 1;
+}
+
+//****************************************************
+//* Tool reads - recorded reply once its time has come
+//****************************************************
+static int replay_read(struct transport* t, void* buf, int len, int timeout) {
+
+uint64_t due,now;
+uint32_t n;
+
+if ((rcur == nrecs) || (recs[rcur].type == 'W')) {
+  // the capture expects a write here - nothing arrives
+  replay_sleep(timeout*1000LL);
+  return 0;
+}
+if (recs[rcur].type == 'T') {
+  // recorded timeout
+  rcur++;
+  replay_sleep(timeout*1000LL);
+  return 0;
+}
+// reply delay after the command, scaled
+if (rspeed != 0) {
+  due=hbase+(uint64_t)((recs[rcur].t-rbase)/rspeed);
+  now=now_us();
+  if (due>now) {
+    if (due-now>timeout*1000LL) {
+      usleep(timeout*1000LL);
+      return 0;
+    }
+    usleep(due-now);
+  }
+}
+n=recs[rcur].len-roff;
+if (n>len) n=len;
+memcpy(buf,recs[rcur].data+roff,n);
+roff+=n;
+if (roff == recs[rcur].len) {
+  rcur++;
+  roff=0;
+}
+return n;
+}
+
+static void replay_flush(struct transport* t) {
+}
+
+static void replay_close(struct transport* t) {
+
+free(t);
+}
+
+static struct tops replay_ops={replay_write,replay_read,replay_flush,replay_close};
+
+//****************************************************
+//* Open replay port
+//*
+//*  spec - <capture file>[@<speed>]
+//****************************************************
+struct transport* replay_open(char* spec) {
+
+char fname[500];
+char* sptr;
+struct transport* t;
+
+snprintf(fname,sizeof(fname),"%s",spec);
+rspeed=1;
+sptr=strrchr(fname,'@');
+if (sptr != 0) {
+  *sptr=0;
+  rspeed=atof(sptr+1);
+}
+if (!replay_load(fname)) return 0;
+
+t=calloc(1,sizeof(struct transport));
+t->ops=&replay_ops;
+t->fd=-1;
+t->timeout=3000;
+t->window=1;
+printf("\n Replaying %s: %i records, ",fname,nrecs);
+if (rspeed == 0) printf("no delays");
+else printf("speed x%g",rspeed);
+return t;
+}
@@ -0,0 +1,6 @@
+#include <stdint.h>
+
+extern char* capname;
+
+void capture_init();
+void capture_data(uint8_t type, void* buf, int len);
@@ -0,0 +1,203 @@
+//
+//   Multithreaded zlib compression
+//
+//  The image is cut into chunks of zchunk bytes which are deflated on all
+//  cores at once. Every chunk but the last ends with a sync flush (an
+//  empty stored block), so the raw deflate streams can simply be
+//  concatenated; the last chunk finishes the stream. Each chunk is primed
+//  with the 32 KB of input before it as dictionary, so the ratio is close
+//  to that of a single-threaded stream.
+//
+//  The result is one ordinary zlib stream with the 78 da header (level 9)
+//  and the Adler-32 of the whole image, combined from the chunk sums:
+//  exactly the format extract() detects and uncompress() reads.
+//
+#include <stdio.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#else
+#include <windows.h>
+#include "printf.h"
+#endif
+
+#include <zlib.h>
+
+#include "compress.h"
+
+// chunk compressed by one thread
+#define zchunk (1024*1024)
+
+// deflate window, the dictionary of a chunk
+#define zwindow 32768
+
+// most threads used
+#define zthreads_max 64
+
+struct zjob {
+  uint8_t* in;
+  uint32_t len;
+  uint32_t dlen;      // dictionary bytes before in
+  int last;
+  uint8_t* out;
+  uint32_t olen;
+  uint32_t adler;
+  int res;            // 0 - ok
+};
+
+static struct zjob* zjobs;
+static int nzjobs;
+static volatile int32_t znext;
+
+#ifndef WIN32
+#define znext_inc() __sync_fetch_and_add(&znext,1)
+#else
+#define znext_inc() (InterlockedIncrement((LONG volatile*)&znext)-1)
+#endif
+
+//****************************************************
+//* Number of processors
+//****************************************************
+static int ncpu() {
+
+#ifndef WIN32
+long n=sysconf(_SC_NPROCESSORS_ONLN);
+#else
+SYSTEM_INFO si;
+long n;
+
+GetSystemInfo(&si);
+n=si.dwNumberOfProcessors;
+#endif
+if (n<1) n=1;
+if (n>zthreads_max) n=zthreads_max;
+return n;
+}
+
+//****************************************************
+//* Deflate one chunk into a raw stream
+//****************************************************
+static void zchunk_deflate(struct zjob* j) {
+
+z_stream s;
+uLong bound;
+
+memset(&s,0,sizeof(s));
+j->adler=adler32(1,j->in,j->len);
+if (deflateInit2(&s,9,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK) {
+  j->res=1;
+  return;
+}
+if (j->dlen != 0) deflateSetDictionary(&s,j->in-j->dlen,j->dlen);
+// room for the sync flush marker as well
+bound=deflateBound(&s,j->len)+16;
+j->out=malloc(bound);
+if (j->out == 0) {
+  deflateEnd(&s);
+  j->res=1;
+  return;
+}
+s.next_in=j->in;
+s.avail_in=j->len;
+s.next_out=j->out;
+s.avail_out=bound;
+if (deflate(&s,j->last?Z_FINISH:Z_SYNC_FLUSH) != (j->last?Z_STREAM_END:Z_OK) || (s.avail_in != 0)) j->res=1;
+j->olen=bound-s.avail_out;
+deflateEnd(&s);
+}
+
+//****************************************************
+//* Compression worker
+//****************************************************
+#ifndef WIN32
+static void* zworker(void* arg) {
+#else
+static DWORD WINAPI zworker(LPVOID arg) {
+#endif
+
+int i;
+
+while ((i=znext_inc()) < nzjobs) zchunk_deflate(&zjobs[i]);
+return 0;
+}
+
+//****************************************************
+//* Compress buffer into a zlib stream on all cores
+//*
+//*  out - allocated compressed data
+//*
+//* returns compressed size, 0 - error
+//****************************************************
+uint32_t zlib_pack(uint8_t* in, uint32_t len, uint8_t** out) {
+
+int i,nt;
+uint32_t off,total,adler;
+uint8_t* buf;
+#ifndef WIN32
+pthread_t th[zthreads_max];
+#else
+HANDLE th[zthreads_max];
+#endif
+
+nzjobs=(len+zchunk-1)/zchunk;
+if (nzjobs == 0) nzjobs=1;
+zjobs=calloc(nzjobs,sizeof(struct zjob));
+for (i=0,off=0;i<nzjobs;i++,off+=zchunk) {
+  zjobs[i].in=in+off;
+  zjobs[i].len=(len-off>zchunk)?zchunk:len-off;
+  zjobs[i].dlen=(off>zwindow)?zwindow:off;
+  zjobs[i].last=(i == nzjobs-1);
+}
+
+znext=0;
+nt=ncpu();
+if (nt>nzjobs) nt=nzjobs;
+for (i=1;i<nt;i++) {
+#ifndef WIN32
+  if (pthread_create(&th[i],0,zworker,0) != 0) break;
+#else
+  th[i]=CreateThread(0,0,zworker,0,0,0);
+  if (th[i] == 0) break;
+#endif
+}
+nt=i;
+// this thread is one of the workers
+zworker(0);
+for (i=1;i<nt;i++) {
+#ifndef WIN32
+  pthread_join(th[i],0);
+#else
+  WaitForSingleObject(th[i],INFINITE);
+  CloseHandle(th[i]);
+#endif
+}
+
+// header, chunks, Adler-32 of the whole input
+total=2+4;
+adler=1;
+for (i=0;i<nzjobs;i++) {
+  if (zjobs[i].res != 0) total=0;
+  if (total != 0) total+=zjobs[i].olen;
+  adler=adler32_combine(adler,zjobs[i].adler,zjobs[i].len);
+}
+buf=(total != 0)?malloc(total):0;
+if (buf != 0) {
+  buf[0]=0x78;
+  buf[1]=0xda;
+  for (i=0,off=2;i<nzjobs;i++) {
+    memcpy(buf+off,zjobs[i].out,zjobs[i].olen);
+    off+=zjobs[i].olen;
+  }
+  buf[off++]=adler>>24;
+  buf[off++]=adler>>16;
+  buf[off++]=adler>>8;
+  buf[off++]=adler;
+}
+for (i=0;i<nzjobs;i++) free(zjobs[i].out);
+free(zjobs);
+*out=buf;
+return (buf != 0)?total:0;
+}
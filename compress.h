@@ -0,0 +1 @@
+uint32_t zlib_pack(uint8_t* in, uint32_t len, uint8_t** out);
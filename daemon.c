@@ -0,0 +1,373 @@
+//
+//   Hotplug flashing daemon for Linux
+//
+//  The firmware is loaded and verified once. New download ports are detected
+//  with inotify on /dev, and every device is flashed by a child process that
+//  inherits the loaded partition table and exits when the device is released.
+//  Session output of a device goes to <tty>.log in the current directory.
+//
+//  A flashed unit reboots and comes back, often on its PCUI port (1c05),
+//  which is a download port candidate as well. Units are told by their USB
+//  serial number: a unit flashed successfully is not flashed again until
+//  new firmware is loaded. A PCUI port without a serial number is ignored,
+//  such a unit cannot be told from the one just flashed.
+//
+//  The loaded firmware can be replaced through the control socket, one
+//  command per connection:
+//
+//    load <file> [<file> ...]  - load and verify new firmware, flashed
+//                                units may be flashed again
+//    status                    - loaded firmware and device counters
+//    quit                      - stop after active devices are finished
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+
+#include "ptable.h"
+#include "flasher.h"
+#include "discover.h"
+#include "daemon.h"
+
+// maximum number of devices flashed at the same time
+#define max_jobs 64
+
+// maximum number of files in the load command
+#define max_files 16
+
+// active flashing processes
+static struct {
+  pid_t pid;
+  char tty[64];
+  char serial[100];   // USB serial number of the unit, empty - unknown
+} jobs[max_jobs];
+static int njobs=0;
+
+// serial numbers of the units flashed with the loaded firmware
+static char (*flashed)[100]=0;
+static int nflashed=0;
+
+// device counters
+static int nok=0,nfail=0;
+
+// loaded firmware file names
+static char fwnames[1000]="";
+
+// daemon parameters
+static int dnflag,dforce,dreboot;
+
+// inotify and control socket fds
+static int ifd=-1,lfd=-1;
+
+//****************************************************
+//* Load firmware into partition table
+//*
+//* returns 1 - firmware loaded and verified
+//****************************************************
+static int load_fw(char** files, int nfiles) {
+
+int i;
+
+free_ptable();
+if (load_files(files,nfiles,dnflag) == -1) return 0;
+if (errflag && !dforce) {
+  printf("\n! Firmware contains errors\n");
+  return 0;
+}
+fwnames[0]=0;
+for (i=0;i<nfiles;i++) {
+  if (strlen(fwnames)+strlen(files[i])+2 >= sizeof(fwnames)) break;
+  if (i != 0) strcat(fwnames," ");
+  strcat(fwnames,files[i]);
+}
+return 1;
+}
+
+//****************************************************
+//* Replace loaded firmware
+//*
+//* New files are first checked in a child process, so a bad
+//* file never leaves the daemon without firmware and cannot
+//* terminate it.
+//****************************************************
+static int reload_fw(char** files, int nfiles) {
+
+int pfd[2];
+pid_t pid;
+char res=0;
+
+if (pipe(pfd) == -1) return 0;
+fflush(stdout);
+pid=fork();
+if (pid == -1) return 0;
+if (pid == 0) {
+  // trial load
+  close(pfd[0]);
+  freopen("/dev/null","w",stdout);
+  if (load_fw(files,nfiles)) write(pfd[1],"1",1);
+  exit(0);
+}
+close(pfd[1]);
+read(pfd[0],&res,1);
+close(pfd[0]);
+waitpid(pid,0,0);
+if (res != '1') return 0;
+if (!load_fw(files,nfiles)) return 0;
+nflashed=0;  // new firmware goes to every unit
+return 1;
+}
+
+//****************************************************
+//* Start flashing of a new device
+//****************************************************
+static void start_job(char* tty) {
+
+char dev[80],logname[80];
+char serial[100];
+pid_t pid;
+int i,fd;
+
+for (i=0;i<njobs;i++) {
+  if (strcmp(jobs[i].tty,tty) == 0) return; // device is already being flashed
+}
+if (njobs == max_jobs) {
+  printf("\n %s: too many devices, ignored",tty);
+  return;
+}
+snprintf(dev,sizeof(dev),"/dev/%s",tty);
+// a unit that came back after flashing
+if (usb_serial(dev,serial,sizeof(serial))) {
+  for (i=0;i<nflashed;i++) {
+    if (strcmp(flashed[i],serial) == 0) {
+      printf("\n %s: unit %s already flashed, ignored",tty,serial);
+      fflush(stdout);
+      return;
+    }
+  }
+}
+else if (is_pcui_tty(tty)) {
+  printf("\n %s: normal mode port of a unit without serial number, ignored",tty);
+  fflush(stdout);
+  return;
+}
+fflush(stdout);
+pid=fork();
+if (pid == -1) {
+  printf("\n %s: process cannot be started",tty);
+  return;
+}
+if (pid == 0) {
+  // flashing process
+  close(ifd);
+  if (lfd != -1) close(lfd);
+  snprintf(logname,sizeof(logname),"%s.log",tty);
+  fd=open(logname,O_WRONLY|O_CREAT|O_APPEND,0644);
+  if (fd != -1) {
+    dup2(fd,1);
+    close(fd);
+  }
+  // udev may still be setting the node up - wait until it can be opened
+  for (i=0;i<50;i++) {
+    fd=open(dev,O_RDWR|O_NOCTTY|O_NONBLOCK);
+    if (fd != -1) break;
+    usleep(100000);
+  }
+  if (fd == -1) exit(-1);
+  close(fd);
+  exit(flash_session(dev,dreboot,0));
+}
+jobs[njobs].pid=pid;
+strcpy(jobs[njobs].tty,tty);
+strcpy(jobs[njobs].serial,serial);
+njobs++;
+printf("\n %s: flashing started",tty);
+fflush(stdout);
+}
+
+//****************************************************
+//* Collect finished flashing processes
+//*
+//*  wait - 1 - block until all processes are finished
+//****************************************************
+static void reap_jobs(int wait) {
+
+pid_t pid;
+int i,status;
+
+while ((njobs != 0) && ((pid=waitpid(-1,&status,wait?0:WNOHANG)) > 0)) {
+  for (i=0;i<njobs;i++) {
+    if (jobs[i].pid == pid) break;
+  }
+  if (i == njobs) continue;
+  if (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+    printf("\n %s: flashed",jobs[i].tty);
+    nok++;
+    if (jobs[i].serial[0] != 0) {
+      flashed=realloc(flashed,(nflashed+1)*sizeof(*flashed));
+      strcpy(flashed[nflashed++],jobs[i].serial);
+    }
+  }
+  else {
+    if (WIFEXITED(status)) printf("\n %s: FAILED, exit code %i",jobs[i].tty,(int8_t)WEXITSTATUS(status));
+    else printf("\n %s: FAILED, signal %i",jobs[i].tty,WTERMSIG(status));
+    nfail++;
+  }
+  fflush(stdout);
+  jobs[i]=jobs[--njobs];
+}
+}
+
+//****************************************************
+//* Process control socket command
+//*
+//* returns 1 - quit command received
+//****************************************************
+static int control(int cfd) {
+
+char cmd[1000],reply[1500];
+char* files[max_files];
+char* sptr;
+int len,n,i;
+struct timeval tv={1,0};
+
+setsockopt(cfd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+len=read(cfd,cmd,sizeof(cmd)-1);
+if (len <= 0) return 0;
+cmd[len]=0;
+cmd[strcspn(cmd,"\r\n")]=0;
+
+if (strncmp(cmd,"load ",5) == 0) {
+  n=0;
+  for (sptr=strtok(cmd+5," ");(sptr != 0) && (n<max_files);sptr=strtok(0," ")) files[n++]=sptr;
+  if ((n != 0) && reload_fw(files,n)) snprintf(reply,sizeof(reply),"OK %i partitions\n",npart);
+  else snprintf(reply,sizeof(reply),"ERROR firmware not loaded, previous firmware kept\n");
+  printf("\n Firmware: %s (%i partitions)",fwnames,npart);
+}
+else if (strcmp(cmd,"status") == 0) {
+  snprintf(reply,sizeof(reply),"firmware: %s\npartitions: %i\nflashed: %i\nfailed: %i\nactive:",fwnames,npart,nok,nfail);
+  for (i=0;i<njobs;i++) {
+    if (strlen(reply)+strlen(jobs[i].tty)+3 >= sizeof(reply)) break;
+    strcat(reply," ");
+    strcat(reply,jobs[i].tty);
+  }
+  strcat(reply,"\n");
+}
+else if (strcmp(cmd,"quit") == 0) {
+  snprintf(reply,sizeof(reply),"OK\n");
+  write(cfd,reply,strlen(reply));
+  return 1;
+}
+else snprintf(reply,sizeof(reply),"ERROR unknown command\n");
+write(cfd,reply,strlen(reply));
+return 0;
+}
+
+//****************************************************
+//* Open control socket
+//****************************************************
+static int control_socket(char* path) {
+
+struct sockaddr_un addr;
+int fd;
+
+fd=socket(AF_UNIX,SOCK_STREAM,0);
+if (fd == -1) return -1;
+memset(&addr,0,sizeof(addr));
+addr.sun_family=AF_UNIX;
+strncpy(addr.sun_path,path,sizeof(addr.sun_path)-1);
+unlink(path);
+if ((bind(fd,(struct sockaddr*)&addr,sizeof(addr)) == -1) || (listen(fd,4) == -1)) {
+  close(fd);
+  return -1;
+}
+return fd;
+}
+
+//****************************************************
+//* Daemon main loop
+//*
+//*  files, nfiles - firmware to load
+//*  nflag - multi-file mode
+//*  force - accept firmware with CRC errors
+//*  ctlpath - control socket path, 0 - no control socket
+//*  reboot - reboot devices after flashing
+//****************************************************
+int run_daemon(char** files, int nfiles, int nflag, int force, char* ctlpath, int reboot) {
+
+struct pollfd pfd[2];
+char evbuf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+struct inotify_event* ev;
+int len,cfd,quit=0;
+char* eptr;
+
+dnflag=nflag;
+dforce=force;
+dreboot=reboot;
+
+if (!load_fw(files,nfiles)) return -1;
+printf("\n\n Firmware: %s (%i partitions)",fwnames,npart);
+
+ifd=inotify_init1(IN_CLOEXEC);
+if ((ifd == -1) || (inotify_add_watch(ifd,"/dev",IN_CREATE) == -1)) {
+  printf("\n! /dev cannot be watched\n");
+  return -1;
+}
+if (ctlpath != 0) {
+  lfd=control_socket(ctlpath);
+  if (lfd == -1) {
+    printf("\n! Control socket %s cannot be created\n",ctlpath);
+    return -1;
+  }
+  printf("\n Control socket: %s",ctlpath);
+}
+signal(SIGPIPE,SIG_IGN);
+printf("\n Waiting for devices in download mode...");
+fflush(stdout);
+
+while (!quit) {
+  pfd[0].fd=ifd;
+  pfd[0].events=POLLIN;
+  pfd[1].fd=lfd;
+  pfd[1].events=POLLIN;
+  pfd[0].revents=pfd[1].revents=0;
+  if ((poll(pfd,(lfd != -1)?2:1,500) == -1) && (errno != EINTR)) break;
+  reap_jobs(0);
+
+  // new device nodes
+  if (pfd[0].revents & POLLIN) {
+    len=read(ifd,evbuf,sizeof(evbuf));
+    for (eptr=evbuf;(len>0) && (eptr<evbuf+len);eptr+=sizeof(struct inotify_event)+ev->len) {
+      ev=(struct inotify_event*)eptr;
+      if ((ev->len != 0) && is_download_tty(ev->name)) start_job(ev->name);
+    }
+  }
+
+  // control commands
+  if (pfd[1].revents & POLLIN) {
+    cfd=accept(lfd,0,0);
+    if (cfd != -1) {
+      quit=control(cfd);
+      close(cfd);
+    }
+  }
+}
+
+printf("\n Stopping, waiting for %i active devices...",njobs);
+fflush(stdout);
+reap_jobs(1);
+if (ctlpath != 0) unlink(ctlpath);
+printf("\n Flashed: %i, failed: %i\n",nok,nfail);
+return 0;
+}
@@ -0,0 +1 @@
+int run_daemon(char** files, int nfiles, int nflag, int force, char* ctlpath, int reboot);
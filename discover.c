@@ -0,0 +1,349 @@
+//
+//   Download port discovery for Linux
+//
+//  Candidate ttys are taken from sysfs and filtered by the USB VID/PID and
+//  interface number of the Balong download port. All candidates are probed
+//  at the same time, each from its own thread.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "hdlcio.h"
+#include "transport.h"
+#include "util.h"
+#include "discover.h"
+
+// Download port USB identifiers (VID 12d1), the same as for Windows port search
+static struct {
+  uint16_t pid;
+  int iface;    // interface number, -1 - any
+} dlports[] = {
+  {0x1c05,2},
+  {0x1442,0},
+  {0x2020,-1},
+  {0,0}
+};
+
+// AT command response deadline while probing, ms
+#define probe_timeout 1500
+
+// probe result for one port
+struct pinfo {
+  char dev[64];
+  uint16_t vid,pid;
+  int iface;
+  char usbpath[32];    // USB topology path, e.g. 1-3.2
+  char* mode;          // dload, at, hdlc, silent, unavailable
+  char dloadver[32];
+  char protocol[32];
+  char ident[100];
+  pthread_t thread;
+  int started;         // probe thread is running
+};
+
+//****************************************************
+//* Read hex value of sysfs attribute
+//****************************************************
+static int sysfs_hex(char* dir, char* attr, unsigned int* val) {
+
+char path[PATH_MAX+64];
+FILE* in;
+int res;
+
+snprintf(path,sizeof(path),"%s/%s",dir,attr);
+in=fopen(path,"r");
+if (in == 0) return 0;
+res=fscanf(in,"%x",val);
+fclose(in);
+return res == 1;
+}
+
+//****************************************************
+//* Get USB identifiers of tty
+//*
+//* returns 1 - tty belongs to a USB device
+//****************************************************
+static int usb_tty(char* tty, struct pinfo* p) {
+
+char path[300];
+char dir[PATH_MAX];
+char* sptr;
+unsigned int vid,pid,iface;
+int level;
+
+snprintf(path,sizeof(path),"/sys/class/tty/%s/device",tty);
+if (realpath(path,dir) == 0) return 0;
+p->iface=-1;
+// walk up from the tty device to the USB interface and the USB device
+for (level=0;level<4;level++) {
+  if ((p->iface == -1) && sysfs_hex(dir,"bInterfaceNumber",&iface)) p->iface=iface;
+  if (sysfs_hex(dir,"idVendor",&vid) && sysfs_hex(dir,"idProduct",&pid)) {
+    p->vid=vid;
+    p->pid=pid;
+    sptr=strrchr(dir,'/');
+    // topology path too long for the port table - not a usable port
+    if (snprintf(p->usbpath,sizeof(p->usbpath),"%s",(sptr != 0)?sptr+1:dir) >= (int)sizeof(p->usbpath)) return 0;
+    return 1;
+  }
+  sptr=strrchr(dir,'/');
+  if ((sptr == 0) || (sptr == dir)) break;
+  *sptr=0;
+}
+return 0;
+}
+
+//****************************************************
+//* Serial number (USB iSerial) of the device of a port
+//*
+//* Identifies the unit, unlike the 0x45 reply which only
+//* names the model. Spaces are replaced with '_'.
+//*
+//* returns 1 - serial number found
+//****************************************************
+int usb_serial(char* devname, char* serial, int len) {
+
+char path[PATH_MAX+64];
+char dir[PATH_MAX];
+char* sptr;
+FILE* in;
+int level,i;
+
+serial[0]=0;
+// the port may be given by a /dev/serial/by-id link
+if (realpath(devname,dir) == 0) return 0;
+sptr=strrchr(dir,'/');
+if (sptr == 0) return 0;
+snprintf(path,sizeof(path),"/sys/class/tty/%s/device",sptr+1);
+if (realpath(path,dir) == 0) return 0;
+// walk up from the tty device to the USB device
+for (level=0;level<4;level++) {
+  snprintf(path,sizeof(path),"%s/serial",dir);
+  in=fopen(path,"r");
+  if (in != 0) {
+    if (fgets(serial,len,in) == 0) serial[0]=0;
+    fclose(in);
+    for (i=0;(serial[i] != 0) && (serial[i] != '\n');i++) {
+      if ((serial[i] <= ' ') || (serial[i]>0x7e)) serial[i]='_';
+    }
+    serial[i]=0;
+    return serial[0] != 0;
+  }
+  sptr=strrchr(dir,'/');
+  if ((sptr == 0) || (sptr == dir)) break;
+  *sptr=0;
+}
+return 0;
+}
+
+//****************************************************
+//* Check whether USB identifiers belong to download port
+//****************************************************
+static int is_dlport(struct pinfo* p) {
+
+int i;
+
+if (p->vid != 0x12d1) return 0;
+for (i=0;dlports[i].pid != 0;i++) {
+  if ((dlports[i].pid == p->pid) && ((dlports[i].iface == -1) || (dlports[i].iface == p->iface))) return 1;
+}
+return 0;
+}
+
+//****************************************************
+//* Check whether tty (name without /dev/) is a download port
+//****************************************************
+int is_download_tty(char* tty) {
+
+struct pinfo p;
+
+if ((strncmp(tty,"ttyUSB",6) != 0) && (strncmp(tty,"ttyACM",6) != 0)) return 0;
+memset(&p,0,sizeof(p));
+return usb_tty(tty,&p) && is_dlport(&p);
+}
+
+//****************************************************
+//* Check whether tty is the PCUI port of a device in normal
+//* mode (1c05), switched to download mode over AT commands
+//****************************************************
+int is_pcui_tty(char* tty) {
+
+struct pinfo p;
+
+memset(&p,0,sizeof(p));
+return usb_tty(tty,&p) && (p.vid == 0x12d1) && (p.pid == 0x1c05);
+}
+
+//****************************************************
+//* Enumerate download port candidates
+//*
+//* plist - result array, 0 - only count candidates
+//* returns number of candidates
+//****************************************************
+static int enum_ports(struct pinfo* plist, int maxports) {
+
+DIR* dir;
+struct dirent* dentry;
+struct pinfo p;
+int n=0;
+
+dir=opendir("/sys/class/tty");
+if (dir == 0) return 0;
+while ((dentry=readdir(dir)) != 0) {
+  if (!is_download_tty(dentry->d_name)) continue;
+  memset(&p,0,sizeof(p));
+  usb_tty(dentry->d_name,&p);
+  if (snprintf(p.dev,sizeof(p.dev),"/dev/%s",dentry->d_name) >= (int)sizeof(p.dev)) continue;
+  if (plist != 0) {
+    if (n >= maxports) break;
+    plist[n]=p;
+  }
+  n++;
+}
+closedir(dir);
+return n;
+}
+
+//****************************************************
+//* Find download port
+//*
+//* devname - buffer for device name
+//* returns 1 - port found
+//****************************************************
+int find_port(char* devname) {
+
+struct pinfo p;
+
+if (enum_ports(&p,1) == 0) return 0;
+strcpy(devname,p.dev);
+return 1;
+}
+
+//****************************************************
+//* List download ports with their USB topology paths
+//*
+//* The topology path (bus-port.port...) stays the same when the
+//* device is replugged, unlike the tty name.
+//*
+//* returns number of ports
+//****************************************************
+int list_usb_ports(char usbpath[][32], char dev[][64], int maxports) {
+
+struct pinfo* plist;
+int i,n;
+
+plist=calloc(maxports+1,sizeof(struct pinfo));
+n=enum_ports(plist,maxports);
+for (i=0;i<n;i++) {
+  strcpy(usbpath[i],plist[i].usbpath);
+  strcpy(dev[i],plist[i].dev);
+}
+free(plist);
+return n;
+}
+
+//****************************************************
+//* Probe one port - thread procedure
+//****************************************************
+static void* probe_port(void* arg) {
+
+struct pinfo* p=arg;
+struct transport* t;
+int res,i;
+uint8_t rbuf[4096];
+unsigned char cmdver[7]={0x0c};
+unsigned char cmd_getproduct[30]={0x45};
+
+t=serial_open(p->dev);
+if (t == 0) {
+  p->mode="unavailable";
+  return 0;
+}
+t->timeout=1000;
+
+// port in AT mode answers ^DLOADVER?
+res=atcmd_t(t,"^DLOADVER?",rbuf,probe_timeout);
+if ((res != 0) && at_done(rbuf,res)) {
+  rbuf[res]=0;
+  if (strstr(rbuf,"ERROR") != 0) p->mode="at";  // AT port without download mode
+  else {
+    p->mode="dload";
+    // version is the first non-empty response line
+    for (i=0;(rbuf[i] == '\r') || (rbuf[i] == '\n');i++);
+    sscanf(rbuf+i,"%31[^\r\n]",p->dloadver);
+  }
+  t->ops->close(t);
+  return 0;
+}
+
+// no AT response - try HDLC protocol version request.
+// The AT command text reaches the bootloader as a bad frame and may get
+// an error reply of its own, so the request is repeated once.
+p->mode="silent";
+for (i=0;i<2;i++) {
+  res=send_cmd_t(t,cmdver,1,rbuf);
+  if (res == 0) continue;
+  p->mode="hdlc";
+  if (rbuf[0] == 0x7e) memmove(rbuf,rbuf+1,res-1);
+  if ((rbuf[0] == 0x0d) && (rbuf[1]<sizeof(p->protocol)) && (rbuf[1]+2<res)) {
+    memcpy(p->protocol,rbuf+2,rbuf[1]);
+    p->protocol[rbuf[1]]=0;
+    break;
+  }
+}
+if (strcmp(p->mode,"hdlc") == 0) {
+  res=send_cmd_t(t,cmd_getproduct,1,rbuf);
+  if (res>2) reply_ident(rbuf,res,p->ident,sizeof(p->ident));
+}
+t->ops->close(t);
+return 0;
+}
+
+//****************************************************
+//* Probe all download ports and print JSON inventory
+//****************************************************
+int discover_ports() {
+
+struct pinfo* plist;
+int i,n;
+
+n=enum_ports(0,0);
+plist=calloc(n+1,sizeof(struct pinfo));
+n=enum_ports(plist,n);
+
+// all ports are probed concurrently
+for (i=0;i<n;i++) {
+  plist[i].started=(pthread_create(&plist[i].thread,0,probe_port,&plist[i]) == 0);
+  if (!plist[i].started) probe_port(&plist[i]);  // no thread - probe in place
+}
+for (i=0;i<n;i++) {
+  if (plist[i].started) pthread_join(plist[i].thread,0);
+}
+
+printf("[");
+for (i=0;i<n;i++) {
+  printf("%s\n  {\"port\": ",(i == 0)?"":",");
+  json_string(stdout,plist[i].dev);
+  printf(", \"usb\": \"%04x:%04x\", \"interface\": %i, \"usbpath\": ",plist[i].vid,plist[i].pid,plist[i].iface);
+  json_string(stdout,plist[i].usbpath);
+  printf(", \"mode\": ");
+  json_string(stdout,plist[i].mode);
+  printf(", \"dloadver\": ");
+  json_string(stdout,(plist[i].dloadver[0] != 0)?plist[i].dloadver:0);
+  printf(", \"protocol\": ");
+  json_string(stdout,(plist[i].protocol[0] != 0)?plist[i].protocol:0);
+  printf(", \"ident\": ");
+  json_string(stdout,(plist[i].ident[0] != 0)?plist[i].ident:0);
+  printf("}");
+}
+printf("\n]\n");
+free(plist);
+return 0;
+}
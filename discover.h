@@ -0,0 +1,6 @@
+int find_port(char* devname);
+int discover_ports();
+int is_download_tty(char* tty);
+int is_pcui_tty(char* tty);
+int usb_serial(char* devname, char* serial, int len);
+int list_usb_ports(char usbpath[][32], char dev[][64], int maxports);
@@ -0,0 +1,309 @@
+//
+//   Flash time estimate
+//
+//  --estimate computes for the loaded partition table the exact number of
+//  bytes that go to the port: HDLC frames of the start, block and end
+//  commands after escaping, with their CRC. The 7e/7d bytes of the images
+//  are counted with SSE2 where available, the frames are not built.
+//
+//  The time is predicted from a link profile of the device model:
+//
+//    partition time = start latency + wire bytes / block rate + end latency per MB * size
+//
+//  With --profiles <file> every completed session updates the profile of
+//  the flashed model (device identifier) from the measured partition
+//  phases, so the estimate follows the real links of the station. Lines of
+//  the profile file:
+//
+//    <model> <block size> <wire bytes/s> <start us> <end us per MB> <sessions>
+//
+#include <stdio.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#else
+#include <windows.h>
+#include <process.h>
+#include "printf.h"
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define est_sse2
+#endif
+
+#include "ptable.h"
+#include "flasher.h"
+#include "util.h"
+#include "estimate.h"
+
+// profile file, 0 - none
+char* profname=0;
+// model used by --estimate, 0 - the only one in the file
+char* modelname=0;
+
+struct lprof {
+  char model[100];
+  uint32_t block;     // block size the profile was measured with
+  double rate;        // wire bytes per second during block transfer
+  double start_us;    // partition start latency
+  double end_us;      // partition end latency per MB of partition
+  uint32_t n;         // sessions measured
+};
+
+// used when no profile is known - a typical USB link
+static struct lprof defprof={"built-in",4096,1000000.0,2000.0,30000.0,0};
+
+// profiles averaged over at most this many sessions
+#define prof_span 8
+
+// data escapes above this share of the image are flagged
+#define esc_flag 0.02
+
+// measurements of the current session
+static uint64_t m_start_us=0,m_block_us=0,m_end_us=0;
+static uint64_t m_wire=0,m_bytes=0;
+static uint32_t m_starts=0;
+
+//****************************************************
+//* Number of bytes that have to be escaped (7e and 7d)
+//****************************************************
+static uint32_t count_escapes(uint8_t* buf, uint32_t len) {
+
+uint32_t i=0,n=0;
+#ifdef est_sse2
+__m128i v7e=_mm_set1_epi8(0x7e);
+__m128i v7d=_mm_set1_epi8(0x7d);
+__m128i zero=_mm_setzero_si128();
+__m128i acc,x,sum;
+int k;
+
+while (i+16 <= len) {
+  // byte counters in acc overflow after 255 steps
+  acc=_mm_setzero_si128();
+  for (k=0;(k<255) && (i+16 <= len);k++,i+=16) {
+    x=_mm_loadu_si128((__m128i*)(buf+i));
+    acc=_mm_sub_epi8(acc,_mm_or_si128(_mm_cmpeq_epi8(x,v7e),_mm_cmpeq_epi8(x,v7d)));
+  }
+  sum=_mm_sad_epu8(acc,zero);
+  n+=_mm_cvtsi128_si32(sum)+_mm_cvtsi128_si32(_mm_srli_si128(sum,8));
+}
+#endif
+for (;i<len;i++) {
+  if ((buf[i] == 0x7e) || (buf[i] == 0x7d)) n++;
+}
+return n;
+}
+
+//****************************************************
+//* Bytes sent for a command: 7e, command, escaped
+//* arguments and CRC, 7e
+//****************************************************
+static uint32_t frame_wire(uint8_t* cmd, int len) {
+
+unsigned short crc;
+
+crc=crc16((char*)cmd,len);
+return len+4+count_escapes(cmd+1,len-1)+count_escapes((uint8_t*)&crc,2);
+}
+
+//****************************************************
+//* Bytes sent for a partition
+//*
+//*  frames - number of frames
+//*  esc - escaped bytes of the image
+//*  bwire - bytes of the block frames
+//****************************************************
+static uint64_t part_wire(int part, uint32_t* frames, uint32_t* esc, uint64_t* bwire) {
+
+uint8_t cmd[7+fblock_max];
+uint32_t blk,blksize,size,v;
+uint16_t s;
+uint64_t wire;
+
+size=ptable[part].hd.psize;
+// start command: code, size, 3 zero bytes
+memset(cmd,0,23);
+cmd[0]=0x41;
+v=htonl(ptable[part].hd.code);
+memcpy(cmd+1,&v,4);
+v=htonl(size);
+memcpy(cmd+5,&v,4);
+wire=frame_wire(cmd,12);
+// end command: size, 3 zero bytes, code, 11 zero bytes
+memset(cmd,0,23);
+cmd[0]=0x43;
+v=htonl(size);
+memcpy(cmd+1,&v,4);
+v=htonl(ptable[part].hd.code);
+memcpy(cmd+8,&v,4);
+wire+=frame_wire(cmd,23);
+*frames=2;
+*esc=0;
+*bwire=0;
+
+// blocks: number, size, data
+cmd[0]=0x42;
+for (blk=0;blk*fblock<size;blk++) {
+  blksize=size-blk*fblock;
+  if (blksize>fblock) blksize=fblock;
+  v=htonl(blk+1);
+  memcpy(cmd+1,&v,4);
+  s=htons(blksize);
+  memcpy(cmd+5,&s,2);
+  memcpy(cmd+7,ptable[part].pimage+blk*fblock,blksize);
+  *esc+=count_escapes(cmd+7,blksize);
+  *bwire+=frame_wire(cmd,7+blksize);
+  (*frames)++;
+}
+return wire+*bwire;
+}
+
+//****************************************************
+//* Find profile of the model in the file
+//*
+//*  model - 0 - the only profile of the file
+//*
+//* returns 0 - not found
+//****************************************************
+static int prof_load(char* model, struct lprof* p) {
+
+FILE* in;
+char line[300];
+struct lprof lp;
+int found=0,count=0;
+
+if (profname == 0) return 0;
+in=fopen(profname,"r");
+if (in == 0) return 0;
+while (fgets(line,sizeof(line),in) != 0) {
+  if (sscanf(line,"%99s %u %lf %lf %lf %u",lp.model,&lp.block,&lp.rate,&lp.start_us,&lp.end_us,&lp.n) != 6) continue;
+  count++;
+  if ((model != 0) && (strcmp(lp.model,model) != 0)) continue;
+  *p=lp;
+  found=1;
+  if (model != 0) break;
+}
+fclose(in);
+if ((model == 0) && (count != 1)) return 0;
+return found;
+}
+
+//****************************************************
+//* Flash time estimate mode
+//****************************************************
+int show_estimate() {
+
+struct lprof prof;
+int part;
+uint32_t frames,esc,tframes=0;
+uint64_t wire,bwire,twire=0,tsize=0;
+double t,ttotal=0,expn;
+int flagged=0;
+
+if (!prof_load(modelname,&prof)) {
+  if (modelname != 0) printf("\n Model %s is not in the profile file, using built-in link profile",modelname);
+  prof=defprof;
+}
+printf("\n Link profile: %s",prof.model);
+if (prof.n != 0) printf(" (%u sessions)",prof.n);
+printf(", %.0f KB/s on the wire, start %.1f ms, end %.1f ms/MB",prof.rate/1024,prof.start_us/1000,prof.end_us/1000);
+if (prof.block != fblock) printf("\n! The profile was measured with block size %u, estimate is for %u",prof.block,fblock);
+
+printf("\n\n##  ---- Partition name ----      size   frames   wire bytes  escapes   time, s");
+for (part=0;part<npart;part++) {
+  wire=part_wire(part,&frames,&esc,&bwire);
+  t=(prof.start_us+prof.end_us*ptable[part].hd.psize/1048576)/1e6+bwire/prof.rate;
+  expn=ptable[part].hd.psize?(double)esc/ptable[part].hd.psize:0;
+  printf("\n%02i  %-20s  %10u  %7u  %11llu  %6.2f%%%s  %8.2f",part,ptable[part].pname,ptable[part].hd.psize,
+         frames,(unsigned long long)wire,expn*100,(expn>esc_flag)?"!":" ",t);
+  if (expn>esc_flag) flagged=1;
+  tsize+=ptable[part].hd.psize;
+  twire+=wire;
+  tframes+=frames;
+  ttotal+=t;
+}
+printf("\n\n Total: %llu bytes in %u frames, %llu bytes on the wire (+%.2f%%)",(unsigned long long)tsize,tframes,
+       (unsigned long long)twire,tsize?(double)(twire-tsize)*100/tsize:0.0);
+printf("\n Estimated flashing time: %.1f s\n",ttotal);
+if (flagged) printf("\n ! - more than %.0f%% of the image bytes are escaped, transfer is slower than usual\n",esc_flag*100);
+return 0;
+}
+
+//****************************************************
+//* Measured phases of a written partition
+//****************************************************
+void profile_part(int part, uint64_t start_us, uint64_t block_us, uint64_t end_us) {
+
+uint32_t frames,esc;
+uint64_t bwire;
+
+if (profname == 0) return;
+m_start_us+=start_us;
+m_block_us+=block_us;
+m_end_us+=end_us;
+m_starts++;
+m_bytes+=ptable[part].hd.psize;
+// only the block frames count for the rate
+part_wire(part,&frames,&esc,&bwire);
+m_wire+=bwire;
+}
+
+//****************************************************
+//* Update the profile of the flashed model
+//****************************************************
+void profile_save(char* model) {
+
+FILE *in,*out;
+char line[300],name[100],tmpname[300];
+struct lprof p,cur;
+int n;
+
+if ((profname == 0) || (m_starts == 0) || (m_block_us == 0) || (m_bytes == 0)) return;
+if (*model == 0) model="unknown";
+
+cur.rate=(double)m_wire*1e6/m_block_us;
+cur.start_us=(double)m_start_us/m_starts;
+cur.end_us=(double)m_end_us*1048576/m_bytes;
+if (prof_load(model,&p) && (p.block == fblock)) {
+  // running average over the last sessions
+  n=(p.n<prof_span)?p.n:prof_span;
+  p.rate=(p.rate*n+cur.rate)/(n+1);
+  p.start_us=(p.start_us*n+cur.start_us)/(n+1);
+  p.end_us=(p.end_us*n+cur.end_us)/(n+1);
+  p.n++;
+}
+else {
+  p=cur;
+  p.n=1;
+}
+strncpy(p.model,model,sizeof(p.model)-1);
+p.model[sizeof(p.model)-1]=0;
+p.block=fblock;
+
+// parallel sessions of a station write their own temporary files
+#ifndef WIN32
+snprintf(tmpname,sizeof(tmpname),"%s.%i.tmp",profname,getpid());
+#else
+snprintf(tmpname,sizeof(tmpname),"%s.%i.tmp",profname,_getpid());
+#endif
+out=fopen(tmpname,"w");
+if (out == 0) {
+  printf("\n! Profile file %s cannot be written",tmpname);
+  return;
+}
+in=fopen(profname,"r");
+if (in != 0) {
+  while (fgets(line,sizeof(line),in) != 0) {
+    if ((sscanf(line,"%99s",name) == 1) && (strcmp(name,p.model) == 0)) continue;
+    fputs(line,out);
+  }
+  fclose(in);
+}
+fprintf(out,"%s %u %.0f %.0f %.0f %u\n",p.model,p.block,p.rate,p.start_us,p.end_us,p.n);
+fclose(out);
+remove(profname);
+rename(tmpname,profname);
+}
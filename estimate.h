@@ -0,0 +1,6 @@
+extern char* profname;
+extern char* modelname;
+
+int show_estimate();
+void profile_part(int part, uint64_t start_us, uint64_t block_us, uint64_t end_us);
+void profile_save(char* model);
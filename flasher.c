@@ -18,9 +18,21 @@
 #endif
 
 #include "hdlcio.h"
+#include "transport.h"
 #include "ptable.h"
 #include "flasher.h"
 #include "util.h"
+#include "journal.h"
+#include "history.h"
+#include "signver.h"
+#include "stats.h"
+#include "trace.h"
+#include "flightrec.h"
+#include "progress.h"
+#include "estimate.h"
+#ifndef WIN32
+#include "discover.h"
+#endif
 
 #define true 1
 #define false 0
@@ -31,12 +43,25 @@
 //***************************************************
 int errcode;
 
+// data block size sent to modem in one command (-b)
+uint32_t fblock=4096;
+
+// block size calibration on the first partition (-b auto)
+int fblock_auto=0;
+
+// block sizes tried by calibration
+static uint32_t cal_sizes[]={1024,2048,4096,8192,0};
+
+// amount of data sent with each block size during calibration
+#define cal_bytes 0x20000
+
 
 //***************************************************
 //* Command error code output
 //***************************************************
 void printerr() {
   
+fr_event(FR_ERROR,0,errcode,0,0,0);
 if (errcode == -1) printf(" - command timeout\n");
 else printf(" - error code %02x\n",errcode);
 }
@@ -74,7 +99,9 @@ static struct {
 
 cmd_dload_init.code=htonl(code);
 cmd_dload_init.size=htonl(size);
+trace_begin("hdlc","dload_start");
 iolen=send_cmd((uint8_t*)&cmd_dload_init,sizeof(cmd_dload_init),replybuf);
+trace_end("hdlc");
 errcode=replybuf[3];
 if ((iolen == 0) || (replybuf[1] != 2)) {
   if (iolen == 0) errcode=-1;
@@ -84,19 +111,18 @@ else return true;
 }  
 
 //***************************************************
-// Send partition block
+// Send partition block without waiting for the reply
 // 
 //  blk - block #
 //  pimage - start address of partition image in memory
 // 
 //*  result:
-//  false - error
-//  true - command accepted by modem
+//  false - write error
+//  true - block sent, the reply is checked by dload_block_reply
 //***************************************************
-int dload_block(uint32_t part, uint32_t blk, uint8_t* pimage) {
+int dload_block_post(uint32_t part, uint32_t blk, uint8_t* pimage) {
 
-uint32_t res,blksize,iolen;
-uint8_t replybuf[4096];
+uint32_t res,blksize;
 
 #ifndef WIN32
 static struct __attribute__ ((__packed__)) {
@@ -107,7 +133,7 @@ static struct {
   uint8_t cmd;
   uint32_t blk;
   uint16_t bsize;
-  uint8_t data[fblock];
+  uint8_t data[fblock_max];
 } cmd_dload_block;  
 #ifdef WIN32
 #pragma pack(pop)
@@ -126,7 +152,29 @@ cmd_dload_block.bsize=htons(blksize);
 // data portion from partition image
 memcpy(cmd_dload_block.data,pimage+blk*fblock,blksize);
 // send block to modem
-iolen=send_cmd((uint8_t*)&cmd_dload_block,sizeof(cmd_dload_block)-fblock+blksize,replybuf); // send command
+trace_begin("hdlc","block");
+res=send_cmd_post((uint8_t*)&cmd_dload_block,sizeof(cmd_dload_block)-fblock_max+blksize);
+// with pipelining the reply comes after the following blocks are sent
+if ((sio->window>1) || !res) trace_end("hdlc");
+if (!res) errcode=-1;
+return res;
+}
+
+//***************************************************
+// Check modem reply to the oldest block sent
+// 
+//*  result:
+//  false - error
+//  true - block accepted by modem
+//***************************************************
+int dload_block_reply() {
+
+uint32_t iolen;
+uint8_t replybuf[4096];
+
+if (sio->window>1) trace_begin("hdlc","block reply");
+iolen=recv_cmd_reply(replybuf);
+trace_end("hdlc");
 
 errcode=replybuf[3];
 if ((iolen == 0) || (replybuf[1] != 2))  {
@@ -136,6 +184,15 @@ if ((iolen == 0) || (replybuf[1] != 2))  {
 return true;
 }
 
+//***************************************************
+// Send partition block and check the reply
+//***************************************************
+int dload_block(uint32_t part, uint32_t blk, uint8_t* pimage) {
+
+if (!dload_block_post(part,blk,pimage)) return false;
+return dload_block_reply();
+}
+
   
 //***************************************************
 // Partition write completion
@@ -172,7 +229,9 @@ static struct {
 cmd_dload_end.cmd=0x43;
 cmd_dload_end.code=htonl(code);
 cmd_dload_end.size=htonl(size);
+trace_begin("hdlc","dload_end");
 iolen=send_cmd((uint8_t*)&cmd_dload_end,sizeof(cmd_dload_end),replybuf);
+trace_end("hdlc");
 errcode=replybuf[3];
 if ((iolen == 0) || (replybuf[1] != 2)) {
   if (iolen == 0) errcode=-1;
@@ -183,45 +242,231 @@ return true;
 
 
 
+//***************************************************
+//* Block size calibration
+//*
+//* Sends the beginning of partition part with each of the
+//* candidate block sizes and keeps the fastest one accepted
+//* by the bootloader. The partition is restarted with a fresh
+//* dload_start for every size, and once more by the caller.
+//***************************************************
+void calibrate(int32_t part) {
+
+int i;
+uint32_t blk,nblk,best=0;
+uint64_t t,rate,bestrate=0;
+
+printf("\n Block size calibration on partition %s:",ptable[part].pname);
+for (i=0;cal_sizes[i] != 0;i++) {
+ if (!dload_start(ptable[part].hd.code,ptable[part].hd.psize)) {
+   printf("\n! Partition header %i (%s) rejected",part,ptable[part].pname);
+   printerr();
+   exit(-2);
+ }  
+ fblock=cal_sizes[i];
+ nblk=(ptable[part].hd.psize+(fblock-1))/fblock;
+ if (nblk>cal_bytes/fblock) nblk=cal_bytes/fblock;
+ t=now_us();
+ for(blk=0;blk<nblk;blk++) {
+   if (!dload_block(part,blk,ptable[part].pimage)) break;
+ }
+ t=now_us()-t+1;
+ if (blk<nblk) {
+   printf("\n  %5i bytes: rejected",fblock);
+   continue;
+ }  
+ rate=(uint64_t)nblk*fblock*1000000/t;  // bytes acknowledged per second
+ printf("\n  %5i bytes: %i blocks, %i KB/s",fblock,nblk,(int)(rate/1024));
+ if (rate>bestrate) {
+   bestrate=rate;
+   best=fblock;
+ }  
+}
+if (best == 0) {
+  printf("\n! No block size is accepted by the bootloader\n");
+  exit(-2);
+}
+fblock=best;
+printf("\n Selected block size: %i\n",fblock);
+}
+
+//***************************************************
+//* Rejected block - the session cannot continue
+//***************************************************
+static void block_rejected(int32_t part, uint32_t blk) {
+
+progress_part_end(0);
+printf("\n! Block %i of partition %i (%s) rejected",blk,part,ptable[part].pname);
+printerr();
+exit(-2);
+}
+
 //***************************************************
 //* Write all partitions from table to modem
 //***************************************************
 void flash_all() {
 
-int32_t part;
-uint32_t blk,maxblock;
+int32_t part,start;
+uint32_t blk,maxblock,done,total=0;
+uint64_t t,ts,tb;
+
+// restart point from the session journal
+start=journal_start();
+for(part=start;part<npart;part++) total+=ptable[part].hd.psize;
+progress_start(total);
 
 printf("\n##  ---- Partition name ---- written");
 // Main partition write loop
 for(part=0;part<npart;part++) {
 printf("\n");  
+ if (part<start) {
+   printf("%02i  %-20s  skipped, written in previous session",part,ptable[part].pname);
+   continue;
+ }  
+ if (history_match(part)) {
+   printf("%02i  %-20s  skipped, unchanged since last flashing",part,ptable[part].pname);
+   progress_skip(ptable[part].hd.psize);
+   journal_done(part);
+   continue;
+ }  
+ history_forget(part);
 //  printf("\n02i %s)",part,ptable[part].pname);
+ // choose block size on the first partition actually written
+ if (fblock_auto) {
+   calibrate(part);
+   fblock_auto=0;
+ }  
+ trace_begin("hdlc","partition %s",ptable[part].pname);
+ fr_note("partition",ptable[part].pname);
+ t=now_us();
  // partition start command
  if (!dload_start(ptable[part].hd.code,ptable[part].hd.psize)) {
    printf("\r! Partition header %i (%s) rejected",part,ptable[part].pname);
    printerr();
    exit(-2);
  }  
+ ts=now_us();
     
  maxblock=(ptable[part].hd.psize+(fblock-1))/fblock; // number of blocks in partition
+ done=0;  // blocks with checked replies
+ // percentage written is shown by the progress reporter
+ progress_part(part);
  // Block-by-block partition image transfer loop
  for(blk=0;blk<maxblock;blk++) {
-  // Output percentage written
-  printf("\r%02i  %-20s  %i%%",part,ptable[part].pname,(blk+1)*100/maxblock); 
-
     // Send next block
-  if (!dload_block(part,blk,ptable[part].pimage)) {
-   printf("\n! Block %i of partition %i (%s) rejected",blk,part,ptable[part].pname);
-   printerr();
-   exit(-2);
-  }  
+  if (!dload_block_post(part,blk,ptable[part].pimage)) block_rejected(part,blk);
+  progress_block((blk+1<maxblock)?fblock:ptable[part].hd.psize-blk*fblock);
+  // replies are checked up to window blocks behind, all of them after the last block
+  while ((blk+1-done >= sio->window) || ((blk+1 == maxblock) && (done<maxblock))) {
+   if (!dload_block_reply()) block_rejected(part,done);
+   done++;
+  }
  }    
+ tb=now_us();
 
 // close partition
  if (!dload_end(ptable[part].hd.code,ptable[part].hd.psize)) {
+   progress_part_end(0);
    printf("\n! Error closing partition %i (%s)",part,ptable[part].pname);
    printerr();
    exit(-2);
  }  
+ progress_part_end(1);
+ stats_part(part,now_us()-t);
+ profile_part(part,ts-t,tb-ts,now_us()-tb);
+ trace_end("hdlc");
+ history_update(part);
+ journal_done(part);
 } // end of partition loop
+progress_stop();
+journal_finish();
+}
+
+
+//***************************************************
+//* Flashing session: port handshake, entering HDLC mode,
+//* writing all partitions and leaving HDLC mode
+//*
+//*  devname - serial port name
+//*  reboot  - 1 - reboot modem at the end, 0 - only leave HDLC mode
+//*  noflash - 1 - only reboot modem, partitions are not written
+//*
+//* returns exit code of the program
+//***************************************************
+int flash_session(char* devname, int reboot, int noflash) {
+
+int res;
+
+// SIO setup
+open_port(devname);
+// the unit is told from other devices of its model by the USB serial number
+unit_id[0]=0;
+#ifndef WIN32
+usb_serial(devname,unit_id,sizeof(unit_id));
+#endif
+fr_start(devname);
+progress_session(devname);
+
+// Determine port mode and dload protocol version
+
+trace_begin("handshake","dloadversion");
+res=dloadversion();
+trace_end("handshake");
+if (res == -1) return -2;
+if (res == 0) {
+  printf("\n Modem is already in HDLC mode");
+  goto hdlc;
+}
+
+// If necessary, send digital signature command
+if (gflag != -1) {
+  trace_begin("handshake","send_signver");
+  send_signver();
+  trace_end("handshake");
+}  
+
+// Enter HDLC mode
+trace_begin("handshake","enter_hdlc");
+enter_hdlc();
+trace_end("handshake");
+
+// Entered HDLC
+//------------------------------
+hdlc:
+
+// get protocol version and device identifier
+trace_begin("handshake","protocol_version");
+protocol_version();
+trace_end("handshake");
+trace_begin("handshake","dev_ident");
+dev_ident();
+trace_end("handshake");
+
+
+printf("\n----------------------------------------------------\n");
+
+if (noflash) {
+  // reboot without specifying a file
+  restart_modem();
+  fr_finish();
+  progress_finish();
+  return 0;
+}  
+
+// Write all flash
+flash_all();
+printf("\n");
+
+port_timeout(1);
+
+// exit HDLC mode and reboot
+trace_begin("handshake",reboot?"restart_modem":"leave_hdlc");
+if (reboot) restart_modem();
+// exit HDLC without reboot
+else leave_hdlc();
+trace_end("handshake");
+profile_save(dev_id);
+fr_finish();
+progress_finish();
+return 0;
 }
@@ -1,5 +1,8 @@
 // размер блока данных, передаваемый модему за одну команду
-#define fblock 4096
-//#define fblock 2048
+extern uint32_t fblock;
+// maximum block size accepted by -b
+#define fblock_max 8192
+extern int fblock_auto;
 
 void flash_all();
+int flash_session(char* devname, int reboot, int noflash);
@@ -0,0 +1,359 @@
+//
+//   Flight recorder of protocol events
+//
+//  The last fr_size events of the session (commands with their block
+//  numbers, replies with latency, AT commands, command errors) are kept in
+//  a fixed ring in memory. Recording an event is one atomic increment and
+//  a copy of at most 40 bytes, nothing is written while the session runs.
+//
+//  The ring is appended to the --flightrec file when the session fails:
+//  the program exits before the session is complete (every protocol error
+//  path ends with exit) or a fatal signal arrives. The dump is formatted
+//  without stdio and written with a single write, so it is safe in a
+//  signal handler and dumps of parallel station processes do not mix.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#include "printf.h"
+#endif
+
+#include "util.h"
+#include "flightrec.h"
+
+// dump file name, 0 - recorder disabled
+char* frname=0;
+
+// ring size, power of 2
+#define fr_size 512
+
+struct frec {
+  uint32_t seq;      // event number + 1, 0 - entry is being written
+  uint32_t arg;      // wire length for commands, error code for errors
+  uint64_t t;        // us
+  uint32_t us;       // reply latency
+  uint16_t len;      // full data length
+  uint8_t type;      // event type, FR_*
+  uint8_t cmd;       // command code for replies
+  uint8_t data[40];  // beginning of the data
+};
+
+static struct frec ring[fr_size];
+static volatile uint32_t fr_next=0;
+
+static int fr_active=0;     // session in progress
+static int fr_dumped=0;
+static char fr_dev[64];
+static uint64_t fr_t0;
+
+#ifndef WIN32
+#define fr_inc(p) __sync_fetch_and_add(p,1)
+#else
+#define fr_inc(p) (InterlockedIncrement((LONG volatile*)(p))-1)
+#endif
+
+//****************************************************
+//* Record event
+//****************************************************
+void fr_event(uint8_t type, uint8_t cmd, uint32_t arg, uint32_t us, void* data, int len) {
+
+uint32_t n;
+struct frec* r;
+
+if (frname == 0) return;
+n=fr_inc(&fr_next);
+r=&ring[n&(fr_size-1)];
+r->seq=0;
+r->t=now_us();
+r->type=type;
+r->cmd=cmd;
+r->arg=arg;
+r->us=us;
+r->len=len;
+if (len>sizeof(r->data)) len=sizeof(r->data);
+if (len>0) memcpy(r->data,data,len);
+r->seq=n+1;
+}
+
+//----------------------------------------------------
+//  Dump formatting without stdio
+//----------------------------------------------------
+
+static char dbuf[fr_size*160+1024];
+static int dlen;
+
+static void put_str(char* s) {
+
+while ((*s != 0) && (dlen<sizeof(dbuf)-1)) dbuf[dlen++]=*s++;
+}
+
+static void put_dec(uint64_t v, int width) {
+
+char tmp[24];
+int n=0;
+
+do {
+  tmp[n++]='0'+v%10;
+  v/=10;
+} while (v != 0);
+while (width-->n) put_str(" ");
+while ((n>0) && (dlen<sizeof(dbuf)-1)) dbuf[dlen++]=tmp[--n];
+}
+
+static void put_hex(uint32_t v, int digits) {
+
+static char hex[]="0123456789abcdef";
+
+while ((digits-->0) && (dlen<sizeof(dbuf)-1)) dbuf[dlen++]=hex[(v>>(digits*4))&0xf];
+}
+
+static uint32_t get_be(uint8_t* p, int n) {
+
+uint32_t v=0;
+
+while (n-->0) v=(v<<8)|*p++;
+return v;
+}
+
+//****************************************************
+//* Data bytes in hex, the rest is shown as length
+//****************************************************
+static void put_bytes(struct frec* r, int from) {
+
+int i,n;
+
+n=(r->len<sizeof(r->data))?r->len:sizeof(r->data);
+for (i=from;(i<n) && (i<from+16);i++) {
+  put_str(" ");
+  put_hex(r->data[i],2);
+}
+if (r->len>i) {
+  put_str(" ... (");
+  put_dec(r->len,0);
+  put_str(" bytes)");
+}
+}
+
+//****************************************************
+//* Printable text of AT command or reply
+//****************************************************
+static void put_text(struct frec* r) {
+
+int i,n;
+
+n=(r->len<sizeof(r->data))?r->len:sizeof(r->data);
+put_str(" \"");
+for (i=0;i<n;i++) {
+  if ((r->data[i]<0x20) || (r->data[i] >= 0x7f)) {
+    put_str("\\x");
+    put_hex(r->data[i],2);
+  }
+  else if (dlen<sizeof(dbuf)-1) dbuf[dlen++]=r->data[i];
+}
+put_str("\"");
+}
+
+//****************************************************
+//* One event line
+//****************************************************
+static void put_event(struct frec* r) {
+
+put_dec((r->t-fr_t0)/1000,8);
+put_str(".");
+put_dec(((r->t-fr_t0)%1000)/100,0);
+put_str(" ms  #");
+put_dec(r->seq-1,0);
+put_str("  ");
+switch (r->type) {
+  case FR_CMD:
+    put_str("cmd ");
+    put_hex(r->data[0],2);
+    switch (r->data[0]) {
+      case 0x41:
+      case 0x43:
+        put_str(r->data[0] == 0x41?" start code ":" end code ");
+        put_hex(get_be(r->data+1,4),8);
+        put_str(" size ");
+        put_dec(get_be(r->data+5,4),0);
+        break;
+      case 0x42:
+        put_str(" block ");
+        put_dec(get_be(r->data+1,4),0);
+        put_str(" size ");
+        put_dec(get_be(r->data+5,2),0);
+        break;
+      default:
+        put_bytes(r,1);
+    }
+    put_str(", wire ");
+    put_dec(r->arg,0);
+    break;
+
+  case FR_REPLY:
+    put_str("reply ");
+    put_hex(r->cmd,2);
+    put_str(" after ");
+    put_dec(r->us,0);
+    put_str(" us:");
+    if (r->len == 0) put_str(" timeout");
+    else put_bytes(r,0);
+    break;
+
+  case FR_AT:
+    put_str("at");
+    put_text(r);
+    break;
+
+  case FR_ATREPLY:
+    put_str("at reply after ");
+    put_dec(r->us,0);
+    put_str(" us:");
+    if (r->len == 0) put_str(" timeout");
+    else put_text(r);
+    break;
+
+  case FR_ERROR:
+    put_str("error ");
+    if (r->arg == (uint32_t)-1) put_str("timeout");
+    else put_hex(r->arg,2);
+    break;
+
+  case FR_NOTE:
+    put_str("--");
+    put_text(r);
+    break;
+}
+put_str("\n");
+}
+
+//****************************************************
+//* Append the ring to the dump file
+//****************************************************
+void fr_dump(char* reason) {
+
+uint32_t n,first,i;
+struct frec* r;
+int fd;
+
+if ((frname == 0) || fr_dumped) return;
+fr_dumped=1;
+n=fr_next;
+first=(n>fr_size)?n-fr_size:0;
+
+dlen=0;
+put_str("=== flight recorder: pid ");
+#ifndef WIN32
+put_dec(getpid(),0);
+#else
+put_dec(_getpid(),0);
+#endif
+put_str(", port ");
+put_str(fr_dev);
+put_str(", ");
+put_str(reason);
+put_str(", ");
+put_dec(n-first,0);
+put_str(" of ");
+put_dec(n,0);
+put_str(" events\n");
+for (i=first;i<n;i++) {
+  r=&ring[i&(fr_size-1)];
+  if (r->seq != i+1) continue;  // overwritten or not finished
+  put_event(r);
+}
+put_str("\n");
+
+#ifndef WIN32
+fd=open(frname,O_WRONLY|O_CREAT|O_APPEND,0644);
+if (fd == -1) return;
+if (write(fd,dbuf,dlen)) {}
+close(fd);
+#else
+fd=_open(frname,_O_WRONLY|_O_CREAT|_O_APPEND|_O_BINARY,0644);
+if (fd == -1) return;
+_write(fd,dbuf,dlen);
+_close(fd);
+#endif
+}
+
+//****************************************************
+//* Exit while the session is in progress
+//****************************************************
+static void fr_exit() {
+
+if (fr_active) fr_dump("session failed");
+}
+
+//****************************************************
+//* Fatal signal
+//****************************************************
+static void fr_signal(int sig) {
+
+char reason[]="signal   ";
+
+reason[7]='0'+sig/10;
+reason[8]='0'+sig%10;
+// interrupting the program between sessions is not a failure
+if (fr_active || ((sig != SIGINT) && (sig != SIGTERM))) fr_dump(reason);
+signal(sig,SIG_DFL);
+raise(sig);
+}
+
+//****************************************************
+//* Session start
+//****************************************************
+void fr_start(char* devname) {
+
+if (frname == 0) return;
+strncpy(fr_dev,devname,sizeof(fr_dev)-1);
+fr_active=1;
+fr_note("session",devname);
+}
+
+//****************************************************
+//* Session completed - nothing to dump
+//****************************************************
+void fr_finish() {
+
+fr_active=0;
+}
+
+//****************************************************
+//* Text note - partition boundaries and such
+//****************************************************
+void fr_note(char* what, char* name) {
+
+char text[40];
+
+if (frname == 0) return;
+snprintf(text,sizeof(text),"%s %s",what,name);
+fr_event(FR_NOTE,0,0,0,text,strlen(text));
+}
+
+//****************************************************
+//* Enable the recorder
+//****************************************************
+void fr_init() {
+
+if (frname == 0) return;
+fr_t0=now_us();
+atexit(fr_exit);
+signal(SIGSEGV,fr_signal);
+signal(SIGFPE,fr_signal);
+signal(SIGILL,fr_signal);
+signal(SIGABRT,fr_signal);
+signal(SIGINT,fr_signal);
+signal(SIGTERM,fr_signal);
+#ifdef SIGBUS
+signal(SIGBUS,fr_signal);
+#endif
+}
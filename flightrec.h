@@ -0,0 +1,16 @@
+// event types
+#define FR_CMD     'C'
+#define FR_REPLY   'R'
+#define FR_AT      'A'
+#define FR_ATREPLY 'a'
+#define FR_ERROR   'E'
+#define FR_NOTE    'N'
+
+extern char* frname;
+
+void fr_init();
+void fr_event(uint8_t type, uint8_t cmd, uint32_t arg, uint32_t us, void* data, int len);
+void fr_note(char* what, char* name);
+void fr_start(char* devname);
+void fr_finish();
+void fr_dump(char* reason);
@@ -0,0 +1,353 @@
+//
+//   HDLC framing and AT commands on top of a transport backend
+//
+//  The framing is the same for every backend; a backend only moves bytes
+//  (see transport.h). Backends are chosen by the port name prefix:
+//
+//    tcp:<host>:<port>         - TCP socket, e.g. ser2net in raw mode
+//    agent:<host>:<port>       - port of a remote balong_flash --agent
+//    pty:[<link>]              - pseudo-terminal for a local modem emulator
+//    replay:<file>[@<speed>]   - session recorded with --capture
+//
+//  Any other name is a serial port.
+//
+#include <stdio.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#else
+#include <windows.h>
+#include "printf.h"
+#endif
+
+#include "hdlcio.h"
+#include "transport.h"
+#include "util.h"
+#include "stats.h"
+#include "capture.h"
+#include "flightrec.h"
+
+// session port
+struct transport* sio=0;
+
+// backends selected by name prefix
+static struct {
+  char* prefix;
+  struct transport* (*open)(char* spec);
+} backends[] = {
+#ifndef WIN32
+  {"tcp:",tcp_open},
+  {"agent:",agent_open},
+  {"pty:",pty_open},
+#endif
+  {"replay:",replay_open},
+  {0,0}
+};
+
+//****************************************************
+//* Open port with a prefixed name
+//*
+//* returns 0 - the name is not a backend prefix (serial port)
+//****************************************************
+struct transport* transport_open(char* devname) {
+
+struct transport* t;
+int i,len;
+
+for (i=0;backends[i].prefix != 0;i++) {
+  len=strlen(backends[i].prefix);
+  if (strncmp(devname,backends[i].prefix,len) != 0) continue;
+  t=backends[i].open(devname+len);
+  if (t == 0) {
+    printf("\n! - Port %s cannot be opened\n", devname); 
+    exit(0);
+  }
+  return t;
+}
+return 0;
+}
+
+//*************************************************
+//* Read and write, the session port is captured
+//*************************************************
+static int tr_read(struct transport* t, void* buf, int len, int timeout) {
+
+int res;
+
+res=t->ops->read(t,buf,len,timeout);
+if (t == sio) capture_data((res>0)?'R':'T',buf,(res>0)?res:0);
+return res;
+}
+
+static int tr_write(struct transport* t, void* buf, int len) {
+
+if (t == sio) capture_data('W',buf,len);
+return t->ops->write(t,buf,len);
+}
+
+//***********************************************************
+//* Escape one byte into the output buffer
+//***********************************************************
+#define put_escaped(c) \
+   switch (c) { \
+     case 0x7e: \
+       outcmdbuf[iolen++]=0x7d; \
+       outcmdbuf[iolen++]=0x5e; \
+       break; \
+     case 0x7d: \
+       outcmdbuf[iolen++]=0x7d; \
+       outcmdbuf[iolen++]=0x5d; \
+       break; \
+     default: \
+       outcmdbuf[iolen++]=c; \
+   }
+
+//***********************************************************
+//* Transform command buffer with Escape substitution
+//*
+//* CRC is appended after the command; the command is escaped
+//* straight from the caller's buffer.
+//***********************************************************
+unsigned int convert_cmdbuf(unsigned char* incmdbuf, int blen, unsigned char* outcmdbuf) {
+
+int i,iolen;
+unsigned short crc;
+unsigned char* crcb=(unsigned char*)&crc;
+
+crc=crc16(incmdbuf,blen);
+
+iolen=0;
+outcmdbuf[iolen++]=incmdbuf[0];  // copy first byte without modifications
+for(i=1;i<blen;i++) {
+  put_escaped(incmdbuf[i]);
+}
+put_escaped(crcb[0]);
+put_escaped(crcb[1]);
+outcmdbuf[iolen++]=0x7e; // terminating byte
+outcmdbuf[iolen]=0;
+return iolen;
+}
+
+//******************************************************************************************
+//* Receive reply frame from modem
+//*
+//* The frame ends with the first 7e after its first byte; whatever
+//* arrives after it in the same read is discarded.
+//******************************************************************************************
+static int receive_reply(struct transport* t, unsigned char* iobuf) {
+
+int i,res,iolen,escflag,incount;
+unsigned char c;
+unsigned char replybuf[14000];
+
+incount=0;
+while (incount<sizeof(replybuf)) {
+  res=tr_read(t,replybuf+incount,sizeof(replybuf)-incount,t->timeout);
+  if (res <= 0) break;
+  for (i=(incount == 0)?1:incount;i<incount+res;i++) {
+    if (replybuf[i] == 0x7e) break;
+  }
+  if (i<incount+res) {
+    incount=i+1;  // end of frame
+    break;
+  }
+  incount+=res;
+}
+if (incount == 0) return 0; // modem did not respond
+
+// Transform received buffer to remove ESC characters
+escflag=0;
+iolen=0;
+for (i=0;i<incount;i++) {
+  c=replybuf[i];
+  if ((c == 0x7e)&&(iolen != 0)) {
+    iobuf[iolen++]=0x7e;
+    break;
+  }
+  if (c == 0x7d) {
+    escflag=1;
+    continue;
+  }
+  if (escflag == 1) {
+    c|=0x20;
+    escflag=0;
+  }
+  iobuf[iolen++]=c;
+}
+return iolen;
+}
+
+//***************************************************
+//* Send command frame and get reply
+//*
+//*  wire - number of bytes sent, 0 - not needed
+//***************************************************
+static int send_frame(struct transport* t, unsigned char* incmdbuf, int blen, unsigned char* iobuf, unsigned int* wire) {
+
+unsigned char outcmdbuf[17000]; // escaped command, up to twice the largest data block
+unsigned int  iolen;
+
+outcmdbuf[0]=0x7e;  // prefix
+iolen=convert_cmdbuf(incmdbuf,blen,outcmdbuf+1)+1;
+if (wire != 0) *wire=iolen;
+if (t == sio) fr_event(FR_CMD,0,iolen,0,incmdbuf,blen);
+t->ops->flush(t);  // flush unread input
+if (!tr_write(t,outcmdbuf,iolen)) {
+  printf("\n Command write error");
+  return 0;
+}
+return receive_reply(t,iobuf);
+}
+
+//***************************************************
+//*  Pipelined commands
+//*
+//* Up to sio->window commands are sent before their replies
+//* are read, replies come back in the order of the commands.
+//* With window 1 a post followed by its reply is the same
+//* exchange as send_cmd.
+//***************************************************
+static struct {
+  uint8_t cmd;
+  uint32_t raw,wire;
+  uint64_t t;
+} posted[max_window];
+static int phead=0;   // oldest command without reply
+
+//***************************************************
+//*  Send command to modem without waiting for the reply
+//***************************************************
+int send_cmd_post(unsigned char* incmdbuf, int blen) {
+
+unsigned char outcmdbuf[17000];
+unsigned int  iolen;
+int n;
+
+outcmdbuf[0]=0x7e;  // prefix
+iolen=convert_cmdbuf(incmdbuf,blen,outcmdbuf+1)+1;
+if (sio->inflight == 0) sio->ops->flush(sio);  // nothing expected - flush unread input
+n=(phead+sio->inflight)%max_window;
+posted[n].cmd=incmdbuf[0];
+posted[n].raw=blen+2;
+posted[n].wire=iolen;
+posted[n].t=now_us();
+fr_event(FR_CMD,0,iolen,0,incmdbuf,blen);
+if (!tr_write(sio,outcmdbuf,iolen)) {
+  printf("\n Command write error");
+  return 0;
+}
+sio->inflight++;
+return 1;
+}
+
+//***************************************************
+//*  Get reply to the oldest posted command
+//***************************************************
+int recv_cmd_reply(unsigned char* iobuf) {
+
+unsigned int rlen;
+
+rlen=receive_reply(sio,iobuf);
+stats_cmd(posted[phead].cmd,now_us()-posted[phead].t,posted[phead].raw,posted[phead].wire,iobuf,rlen);
+fr_event(FR_REPLY,posted[phead].cmd,0,now_us()-posted[phead].t,iobuf,rlen);
+phead=(phead+1)%max_window;
+sio->inflight--;
+return rlen;
+}
+
+//***************************************************
+//*  Send command to port t and get result
+//***************************************************
+int send_cmd_t(struct transport* t, unsigned char* incmdbuf, int blen, unsigned char* iobuf) {
+
+return send_frame(t,incmdbuf,blen,iobuf,0);
+}
+
+//***************************************************
+//*  Send command to modem and get result
+//***************************************************
+int send_cmd(unsigned char* incmdbuf, int blen, unsigned char* iobuf) {
+
+unsigned int rlen,wire=0;
+uint64_t t=now_us();
+
+rlen=send_frame(sio,incmdbuf,blen,iobuf,&wire);
+stats_cmd(incmdbuf[0],now_us()-t,blen+2,wire,iobuf,rlen);
+fr_event(FR_REPLY,incmdbuf[0],0,now_us()-t,iobuf,rlen);
+return rlen;
+}
+
+//****************************************************
+//*  Send AT command to modem on port t
+//*
+//* cmd - command buffer
+//* rbuf - buffer for response, at least 200 bytes
+//* timeout - response deadline, ms
+//*
+//* Reading stops as soon as the final result line (OK/ERROR) arrives.
+//* A response without a final result line is accepted after 100 ms of silence.
+//*
+//* Returns response length
+//****************************************************
+int atcmd_t(struct transport* t, char* cmd, char* rbuf, int timeout) {
+
+int res,len=0;
+char cbuf[128];
+int64_t left;
+uint64_t deadline;
+
+strcpy(cbuf,"AT");
+strcat(cbuf,cmd);
+strcat(cbuf,"\r");
+
+// Clean receiver buffer
+t->ops->flush(t);
+
+// send command
+tr_write(t,cbuf,strlen(cbuf));
+deadline=now_us()+timeout*1000LL;
+
+// read result
+while (len<200) {
+  left=((int64_t)(deadline-now_us()))/1000;
+  if (left <= 0) break;
+  if ((len != 0) && (left>100)) left=100;  // partial response - wait for the rest only briefly
+  res=tr_read(t,rbuf+len,200-len,left);
+  if (res <= 0) break;
+  len+=res;
+  if (at_done(rbuf,len)) break;
+}
+return len;
+}
+
+//****************************************************
+//*  Send AT command to modem
+//****************************************************
+int atcmd_wait(char* cmd, char* rbuf, int timeout) {
+
+int res;
+uint64_t t=now_us();
+
+fr_event(FR_AT,0,0,0,cmd,strlen(cmd));
+res=atcmd_t(sio,cmd,rbuf,timeout);
+stats_at(now_us()-t,strlen(cmd)+3,rbuf,res);
+fr_event(FR_ATREPLY,0,0,now_us()-t,rbuf,res);
+return res;
+}
+
+//****************************************************
+//*  Send AT command to modem with default 10 s deadline
+//****************************************************
+int atcmd(char* cmd, char* rbuf) {
+
+return atcmd_wait(cmd,rbuf,10000);
+}
+
+//*************************************
+// Configure reply timeout, 0.1 s units
+//*************************************
+void port_timeout(int timeout) {
+
+sio->timeout=timeout*100;
+}
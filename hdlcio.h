@@ -1,10 +1,16 @@
-extern int siofd; // fd для работы с Последовательным портом
-
 int send_cmd(unsigned char* incmdbuf, int blen, unsigned char* iobuf);
 int open_port(char* devname);
-int find_file(int num, char* dirname, char* filename,unsigned int* id, unsigned int* size);
+
+// regular file of a directory
+struct dfile {
+  char name[256];
+  unsigned int size;
+};
+int list_dir(char* dirname, struct dfile** list);
+
 void port_timeout(int timeout);
 int atcmd(char* cmd, char* rbuf);
+int atcmd_wait(char* cmd, char* rbuf, int timeout);
 
 #ifdef WIN32
 #define usleep(x) Sleep(x/1000)
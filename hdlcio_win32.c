@@ -1,4 +1,4 @@
-//  Low-level procedures for working with serial port and HDLC
+//  Serial port backend and port search for Windows
 
 #include <stdio.h>
 #include <windows.h>
@@ -7,6 +7,7 @@
 #include "printf.h"
 
 #include "hdlcio.h"
+#include "transport.h"
 #include "util.h"
 
 unsigned int nand_cmd=0x1b400000;
@@ -20,159 +21,105 @@ unsigned int oobsize=0;
 
 static char pdev[500]; // serial port name
 
-int siofd; // fd for working with serial port
-static HANDLE hSerial;
-
-static int read(int siofd, void* buf, unsigned int len)
-{
-    DWORD bytes_read = 0;
-
-    ReadFile(hSerial, buf, len, &bytes_read, NULL);
- 
-    return bytes_read;
-}
-
-static int write(int siofd, void* buf, unsigned int len)
-{
-    DWORD bytes_written = 0;
-
-    WriteFile(hSerial, buf, len, &bytes_written, NULL);
-
-    return bytes_written;
-}
+// serial port data
+struct wserial {
+  HANDLE h;
+  int timeout;   // timeout set in the port, ms
+};
 
 //*************************************************
-//*    send buffer to modem
+//* Serial backend
 //*************************************************
-unsigned int send_unframed_buf(char* outcmdbuf, unsigned int outlen) {
-
+static int serial_write(struct transport* t, void* buf, int len) {
 
-PurgeComm(hSerial, PURGE_RXCLEAR);
-
-write(siofd,"\x7e",1);  // send prefix
-
-if (write(siofd,outcmdbuf,outlen) == 0) {   printf("\n Command write error");return 0;  }
-FlushFileBuffers(hSerial);
+struct wserial* ws=t->ctx;
+DWORD bytes_written = 0;
 
+if (!WriteFile(ws->h, buf, len, &bytes_written, NULL) || (bytes_written != len)) return 0;
+FlushFileBuffers(ws->h);
 return 1;
 }
 
-//******************************************************************************************
-//* Receive response buffer from modem
-//*
-//*  masslen - number of bytes received as a single block without analyzing end marker 7F
-//******************************************************************************************
+static int serial_read(struct transport* t, void* buf, int len, int timeout) {
 
-unsigned int receive_reply(char* iobuf, int masslen) {
-  
-int i,iolen,escflag,bcnt,incount;
-unsigned char c;
-unsigned int res;
-unsigned char replybuf[14000];
-
-incount=0;
-if (read(siofd,&c,1) != 1) {
-//  printf("\n No response from modem");
-  return 0; // modem did not respond or responded incorrectly
+struct wserial* ws=t->ctx;
+COMMTIMEOUTS CommTimeouts;
+DWORD bytes_read = 0;
+
+// return what has arrived as soon as there is at least one byte
+if (timeout != ws->timeout) {
+  CommTimeouts.ReadIntervalTimeout = MAXDWORD;
+  CommTimeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+  CommTimeouts.ReadTotalTimeoutConstant = timeout;
+  CommTimeouts.WriteTotalTimeoutConstant = 0;
+  CommTimeouts.WriteTotalTimeoutMultiplier = 0;
+  SetCommTimeouts(ws->h, &CommTimeouts);
+  ws->timeout=timeout;
 }
-//if (c != 0x7e) {
-//  printf("\n First byte of response - not 7e: %02x",c);
-//  return 0; // modem did not respond or responded incorrectly
-//}
-replybuf[incount++]=c;
-
-// read data array as single block when processing command 03
-if (masslen != 0) {
- res=read(siofd,replybuf+1,masslen-1);
- if (res != (masslen-1)) {
-   printf("\nResponse from modem too short: %i bytes, expected %i bytes\n",res+1,masslen);
-   dump(replybuf,res+1,0);
-   return 0;
- }  
- incount+=masslen-1; // we already have masslen bytes in buffer
-// printf("\n ------ it mass --------");
-// dump(replybuf,incount,0);
+if (!ReadFile(ws->h, buf, len, &bytes_read, NULL)) return 0;
+return bytes_read;
 }
 
-// receive remaining buffer tail
-while (read(siofd,&c,1) == 1)  {
- replybuf[incount++]=c;
-// printf("\n-- %02x",c);
- if (c == 0x7e) break;
-}
+static void serial_flush(struct transport* t) {
 
-// Transform received buffer to remove ESC characters
-escflag=0;
-iolen=0;
-for (i=0;i<incount;i++) { 
-  c=replybuf[i];
-  if ((c == 0x7e)&&(iolen != 0)) {
-    iobuf[iolen++]=0x7e;
-    break;
-  }  
-  if (c == 0x7d) {
-    escflag=1;
-    continue;
-  }
-  if (escflag == 1) { 
-    c|=0x20;
-    escflag=0;
-  }  
-  iobuf[iolen++]=c;
-}  
-return iolen;
+struct wserial* ws=t->ctx;
 
+PurgeComm(ws->h, PURGE_RXCLEAR);
 }
 
-//***********************************************************
-//* Transform command buffer with Escape substitution
-//***********************************************************
-unsigned int convert_cmdbuf(char* incmdbuf, int blen, char* outcmdbuf) {
-
-int i,iolen,escflag,bcnt,incount;
-unsigned char cmdbuf[14096];
-
-bcnt=blen;
-memcpy(cmdbuf,incmdbuf,blen);
-// Write CRC at end of buffer
-*((unsigned short*)(cmdbuf+bcnt))=crc16(cmdbuf,bcnt);
-bcnt+=2;
-
-// Transform data with ESC-sequence escaping
-iolen=0;
-outcmdbuf[iolen++]=cmdbuf[0];  // copy first byte without modifications
-for(i=1;i<bcnt;i++) {
-   switch (cmdbuf[i]) {
-     case 0x7e:
-       outcmdbuf[iolen++]=0x7d;
-       outcmdbuf[iolen++]=0x5e;
-       break;
-      
-     case 0x7d:
-       outcmdbuf[iolen++]=0x7d;
-       outcmdbuf[iolen++]=0x5d;
-       break;
-      
-     default:
-       outcmdbuf[iolen++]=cmdbuf[i];
-   }
- }
-outcmdbuf[iolen++]=0x7e; // terminating byte
-outcmdbuf[iolen]=0;
-return iolen;
+static void serial_close(struct transport* t) {
+
+struct wserial* ws=t->ctx;
+
+CloseHandle(ws->h);
+free(ws);
+free(t);
 }
 
+static struct tops serial_ops={serial_write,serial_read,serial_flush,serial_close};
+
 //***************************************************
-//*  Send command to port and get result  *
+// Open and configure serial port
+//
+//  device - \\.\COMn
 //***************************************************
-int send_cmd(unsigned char* incmdbuf, int blen, unsigned char* iobuf) {
-  
-unsigned char outcmdbuf[14096];
-unsigned int  iolen;
+struct transport* serial_open(char* device) {
+
+DCB dcbSerialParams = {0};
+HANDLE h;
+struct wserial* ws;
+struct transport* t;
+
+h = CreateFileA(device, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+if (h == INVALID_HANDLE_VALUE) return 0;
 
-iolen=convert_cmdbuf(incmdbuf,blen,outcmdbuf);  
-if (!send_unframed_buf(outcmdbuf,iolen)) return 0; // command transmission error
-return receive_reply(iobuf,0);
+ZeroMemory(&dcbSerialParams, sizeof(dcbSerialParams));
+dcbSerialParams.DCBlength=sizeof(dcbSerialParams);
+dcbSerialParams.BaudRate = CBR_115200;
+dcbSerialParams.ByteSize = 8;
+dcbSerialParams.StopBits = ONESTOPBIT;
+dcbSerialParams.Parity = NOPARITY;
+dcbSerialParams.fBinary = TRUE;
+dcbSerialParams.fDtrControl = DTR_CONTROL_ENABLE;
+dcbSerialParams.fRtsControl = RTS_CONTROL_ENABLE;
+if (!SetCommState(h, &dcbSerialParams))
+{
+    CloseHandle(h);
+    printf("\n! - Error initializing COM port\n"); 
+    return 0;
+}
+PurgeComm(h, PURGE_RXCLEAR);
+
+ws=calloc(1,sizeof(struct wserial));
+ws->h=h;
+ws->timeout=-1;
+t=calloc(1,sizeof(struct transport));
+t->ops=&serial_ops;
+t->fd=-1;
+t->ctx=ws;
+t->timeout=30000;
+t->window=1;
+return t;
 }
 
 DEFINE_GUID(GUID_DEVCLASS_PORTS, 0x4D36E978, 0xE325, 0x11CE, 0xBF, 0xC1, 0x08, 0x00, 0x2B, 0xE1, 0x03, 0x18);
@@ -247,13 +194,13 @@ static int find_port(int* port_no, char* port_name)
 
 int open_port(char* devname) {
 
-DCB dcbSerialParams = {0};
-COMMTIMEOUTS CommTimeouts;
-
 char device[20] = "\\\\.\\COM";
 int port_no;
 char port_name[256];
 
+sio=transport_open(devname);
+if (sio != 0) return 1;
+
 if (*devname == '\0')
 {
   printf("\n\nSearching for flashing port...\n");
@@ -274,153 +221,50 @@ if (*devname == '\0')
 
 strcat(device, devname);
 
-hSerial = CreateFileA(device, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-if (hSerial == INVALID_HANDLE_VALUE)
+sio=serial_open(device);
+if (sio == 0)
 {
    printf("\n! - Serial port COM%s cannot be opened\n", devname); 
    exit(0); 
 }
-
-ZeroMemory(&dcbSerialParams, sizeof(dcbSerialParams));
-dcbSerialParams.DCBlength=sizeof(dcbSerialParams);
-dcbSerialParams.BaudRate = CBR_115200;
-dcbSerialParams.ByteSize = 8;
-dcbSerialParams.StopBits = ONESTOPBIT;
-dcbSerialParams.Parity = NOPARITY;
-dcbSerialParams.fBinary = TRUE;
-dcbSerialParams.fDtrControl = DTR_CONTROL_ENABLE;
-dcbSerialParams.fRtsControl = RTS_CONTROL_ENABLE;
-if (!SetCommState(hSerial, &dcbSerialParams))
-{
-    CloseHandle(hSerial);
-    printf("\n! - Error initializing COM port\n"); 
-    exit(0); 
-    //return -1;
-}
-
-CommTimeouts.ReadIntervalTimeout = 5;
-CommTimeouts.ReadTotalTimeoutConstant = 30000;
-CommTimeouts.ReadTotalTimeoutMultiplier = 0;
-CommTimeouts.WriteTotalTimeoutConstant = 0;
-CommTimeouts.WriteTotalTimeoutMultiplier = 0;
-if (!SetCommTimeouts(hSerial, &CommTimeouts))
-{
-    CloseHandle(hSerial);
-    printf("\n! - Error initializing COM port\n"); 
-    exit(0); 
-}
-
-PurgeComm(hSerial, PURGE_RXCLEAR);
-
 return 1;
 }
 
-
-//*************************************
-// Configure port timeout
-//*************************************
-
-void port_timeout(int timeout) {
-}
-
 //*************************************************
-//*  Find file by number in specified directory
+//*  List regular files of a directory
+//*
+//* One pass over the directory, sizes come with the
+//* directory entries.
 //*
-//* num - file #
-//* filename - buffer for full file name
-//* id - variable where partition identifier will be written
+//* list - allocated array of files
 //*
-//* return 0 - not found
-//*        1 - found
+//* return number of files
 //*************************************************
-int find_file(int num, char* dirname, char* filename,unsigned int* id, unsigned int* size) {
+int list_dir(char* dirname, struct dfile** list) {
 
-
-char fpattern[80];
-char fname[_MAX_PATH];
+char fpattern[_MAX_PATH];
 struct _finddata_t fileinfo;
 intptr_t res;
-FILE* in;
-unsigned int pt;
+int n=0,size=0;
 
-sprintf(fpattern,"%s\\%02d*", dirname, num);
+snprintf(fpattern,sizeof(fpattern),"%s\\*",dirname);
+*list=0;
 res = _findfirst(fpattern, &fileinfo);
-_findclose(res);
-if (res == -1)
-    return 0;
-if ((fileinfo.attrib & _A_SUBDIR) != 0)
-    return 0;
-strcpy(fname, fileinfo.name);
-strcpy(filename, dirname);
-strcat(filename, "\\");
-strcat(filename, fname);  
-
-// 00-00000200-M3Boot.bin
-// check file name for presence of '-' characters
-if (fname[2] != '-' || fname[11] != '-') {
-  printf("\n Incorrect file name format - %s\n",fname);
+if (res == -1) {
+  printf("\n Directory %s cannot be opened\n",dirname);
   exit(1);
 }
-
-// check partition ID digit field
-if (strspn(fname+3,"0123456789AaBbCcDdEeFf") != 8) {
-  printf("\n Error in partition identifier - non-digit character - %s\n",filename);
-  exit(1);
-}  
-sscanf(fname+3,"%8x",id);
-
-// Check file accessibility and readability
-in=fopen(filename,"rb");
-if (in == 0) {
-  printf("\n Error opening file %s\n",filename);
-  exit(1);
-}
-if (fread(&pt,1,4,in) != 4) {
-  printf("\n Error reading file %s\n",filename);
-  exit(1);
-}
-  
-// check that file is raw image, without header
-if (pt == 0xa55aaa55) {
-  printf("\n File %s has a header - not suitable for flashing\n",filename);
-  exit(1);
-}
-
-fclose(in);
-
-*size = fileinfo.size;
-
-
-return 1;
-}
-
-//****************************************************
-//*  Send AT command to modem
-//*  
-//* cmd - command buffer
-//* rbuf - buffer for response
-//*
-//* Returns response length
-//****************************************************
-int atcmd(char* cmd, char* rbuf) {
-
-int res;
-char cbuf[128];
-
-strcpy(cbuf,"AT");
-strcat(cbuf,cmd);
-strcat(cbuf,"\r");
-
-port_timeout(100);
-// Clean receiver and transmitter buffer
-PurgeComm(hSerial, PURGE_RXCLEAR);
-
-// send command
-write(siofd,cbuf,strlen(cbuf));
-Sleep(100);
-
-// read result
-res=read(siofd,rbuf,200);
-return res;
+do {
+  if ((fileinfo.attrib & _A_SUBDIR) != 0) continue;
+  if (strlen(fileinfo.name) >= sizeof((*list)->name)) continue;
+  if (n == size) {
+    size=size?size*2:64;
+    *list=realloc(*list,size*sizeof(struct dfile));
+  }
+  strcpy((*list)[n].name,fileinfo.name);
+  (*list)[n].size=fileinfo.size;
+  n++;
+} while (_findnext(res, &fileinfo) == 0);
+_findclose(res);
+return n;
 }
-  
@@ -0,0 +1,182 @@
+//
+//   Flash history for incremental flashing
+//
+//  For every unit the history file keeps the content hash of each
+//  partition last written to it:
+//
+//    <device identifier>@<unit serial number> <partition code> <size> <hash>
+//
+//  The identifier from the 0x45 command only names the model, so the unit
+//  is told by its USB serial number. When it is unknown, no partition is
+//  skipped and nothing is recorded.
+//
+//  A partition entry is dropped before the partition is started and written
+//  again after dload_end succeeded, so an interrupted write never leaves a
+//  stale "unchanged" record behind.
+//
+#include <stdio.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#else
+#include <windows.h>
+#include "printf.h"
+#endif
+
+#include "ptable.h"
+#include "util.h"
+#include "history.h"
+
+// history file name, 0 - incremental mode disabled
+char* hname=0;
+
+// forced full flashing - all partitions are written, history is still updated
+int hfull=0;
+
+// history records
+struct hrec {
+  char dev[200];
+  uint32_t code;
+  uint32_t size;
+  uint64_t hash;
+};
+
+static struct hrec* hist=0;
+static int nhist=0;
+static int hloaded=0;
+
+// key of the current unit
+static char hkey[200];
+
+//****************************************************
+//* Load history file
+//****************************************************
+static void history_load() {
+
+FILE* in;
+char line[300];
+struct hrec r;
+uint32_t hhi,hlo;
+
+hloaded=1;
+in=fopen(hname,"r");
+if (in == 0) return; // no history yet
+while (fgets(line,sizeof(line),in) != 0) {
+  if (sscanf(line,"%199s %x %u %8x%8x",r.dev,&r.code,&r.size,&hhi,&hlo) != 5) continue;
+  r.hash=((uint64_t)hhi<<32)|hlo;
+  hist=realloc(hist,(nhist+1)*sizeof(struct hrec));
+  hist[nhist++]=r;
+}
+fclose(in);
+}
+
+//****************************************************
+//* Write history file
+//****************************************************
+static void history_save() {
+
+FILE* out;
+char tmpname[300];
+int i;
+
+snprintf(tmpname,sizeof(tmpname),"%s.tmp",hname);
+out=fopen(tmpname,"w");
+if (out == 0) {
+  printf("\n! History file %s cannot be written\n",tmpname);
+  exit(-1);
+}
+for (i=0;i<nhist;i++) {
+  fprintf(out,"%s %08x %u %08x%08x\n",hist[i].dev,hist[i].code,hist[i].size,
+         (uint32_t)(hist[i].hash>>32),(uint32_t)hist[i].hash);
+}
+fclose(out);
+remove(hname);
+rename(tmpname,hname);
+}
+
+//****************************************************
+//* Key of the connected unit
+//*
+//* returns 0 - unit cannot be identified
+//****************************************************
+static int unit_key() {
+
+static int warned=0;
+
+if ((dev_id[0] == 0) || (unit_id[0] == 0)) {
+  if (!warned) printf("\n Serial number of the unit is unknown, incremental flashing disabled - all partitions are written");
+  warned=1;
+  return 0;
+}
+snprintf(hkey,sizeof(hkey),"%s@%s",dev_id,unit_id);
+return 1;
+}
+
+//****************************************************
+//* Search for history record of partition on current device
+//*
+//* returns record index or -1
+//****************************************************
+static int history_find(int part) {
+
+int i;
+
+if (hname == 0) return -1;
+if (!hloaded) history_load();
+if (!unit_key()) return -1;    // unit unknown
+for (i=0;i<nhist;i++) {
+  if ((hist[i].code == ptable[part].hd.code) && (strcmp(hist[i].dev,hkey) == 0)) return i;
+}
+return -1;
+}
+
+//****************************************************
+//* Check whether partition on the device already holds
+//* this image
+//*
+//* returns 1 - partition unchanged, may be skipped
+//****************************************************
+int history_match(int part) {
+
+int i;
+
+if (hfull) return 0;
+i=history_find(part);
+if (i == -1) return 0;
+return (hist[i].size == ptable[part].hd.psize) && (hist[i].hash == ptable[part].phash);
+}
+
+//****************************************************
+//* Drop record of partition before it is rewritten
+//****************************************************
+void history_forget(int part) {
+
+int i;
+
+i=history_find(part);
+if (i == -1) return;
+hist[i]=hist[--nhist];
+history_save();
+}
+
+//****************************************************
+//* Record partition successfully written to device
+//****************************************************
+void history_update(int part) {
+
+int i;
+
+if (hname == 0) return;
+i=history_find(part);
+if (i == -1) {
+  if (!unit_key()) return;
+  hist=realloc(hist,(nhist+1)*sizeof(struct hrec));
+  i=nhist++;
+  strcpy(hist[i].dev,hkey);
+  hist[i].code=ptable[part].hd.code;
+}
+hist[i].size=ptable[part].hd.psize;
+hist[i].hash=ptable[part].phash;
+history_save();
+}
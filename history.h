@@ -0,0 +1,6 @@
+extern char* hname;
+extern int hfull;
+
+int history_match(int part);
+void history_forget(int part);
+void history_update(int part);
@@ -0,0 +1,281 @@
+//
+//   Search for firmware images in a file
+//
+//  The file is mapped into memory and searched for the partition header
+//  magic 55 aa 5a a5 at any alignment: SSE2 compares 16 positions at once
+//  where available, memchr elsewhere. A candidate is accepted when its
+//  header CRC is right; the partition chain is then followed to the end
+//  of the image and the search continues after it, so all BIN images
+//  embedded in an EXE updater are found. An image whose first headers
+//  are damaged still starts at its first header when the chain from
+//  there leads to a header with the right CRC.
+//
+//  Partitions of an image start at 4-byte boundaries counted from the
+//  0x5c-byte file prefix in front of the first header.
+//
+#include <stdio.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#else
+#include <windows.h>
+#include "printf.h"
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define scan_sse2
+#endif
+
+#include "ptable.h"
+#include "util.h"
+#include "signver.h"
+#include "imgscan.h"
+
+// image to load from files with several images, -1 - the first one
+int image_sel=-1;
+
+// size of the file prefix in front of the first header
+#define prefix_size 0x5c
+
+// damaged headers remembered in front of an image
+#define max_weak 16
+
+//****************************************************
+//* Next position of the magic from pos
+//*
+//* returns -1 - not found
+//****************************************************
+static int64_t find_magic(uint8_t* buf, uint64_t size, uint64_t pos) {
+
+uint8_t* p;
+#ifdef scan_sse2
+__m128i v55=_mm_set1_epi8(0x55);
+__m128i vaa=_mm_set1_epi8((char)0xaa);
+int mask,bit;
+
+// 55 followed by aa, 16 positions per step
+while (pos+17 <= size) {
+  mask=_mm_movemask_epi8(_mm_and_si128(
+         _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(buf+pos)),v55),
+         _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(buf+pos+1)),vaa)));
+  while (mask != 0) {
+    for (bit=0;(mask&(1<<bit)) == 0;bit++);
+    if ((pos+bit+4 <= size) && (buf[pos+bit+2] == 0x5a) && (buf[pos+bit+3] == 0xa5)) return pos+bit;
+    mask&=mask-1;
+  }
+  pos+=16;
+}
+#endif
+while (pos+4 <= size) {
+  p=memchr(buf+pos,0x55,size-pos-3);
+  if (p == 0) return -1;
+  pos=p-buf;
+  if ((p[1] == 0xaa) && (p[2] == 0x5a) && (p[3] == 0xa5)) return pos;
+  pos++;
+}
+return -1;
+}
+
+//****************************************************
+//* Header fits in the file and its sizes are sane
+//****************************************************
+static int header_fits(uint8_t* buf, uint64_t size, uint64_t pos) {
+
+struct pheader hd;
+
+if (pos+sizeof(struct pheader)>size) return 0;
+memcpy(&hd,buf+pos,sizeof(hd));
+return (hd.hdsize >= sizeof(struct pheader)) && (hd.hdsize+(uint64_t)hd.psize <= size-pos);
+}
+
+//****************************************************
+//* Header CRC is right
+//****************************************************
+static int header_valid(uint8_t* buf, uint64_t size, uint64_t pos) {
+
+struct pheader hd;
+uint16_t crc;
+
+if (!header_fits(buf,size,pos)) return 0;
+memcpy(&hd,buf+pos,sizeof(hd));
+crc=hd.crc;
+hd.crc=0;
+return crc16((char*)&hd,sizeof(hd)) == crc;
+}
+
+//****************************************************
+//* Follow the partition chain of an image
+//*
+//* returns end of the image
+//****************************************************
+static uint64_t walk_chain(uint8_t* buf, uint64_t size, struct fwimage* img) {
+
+struct pheader hd;
+uint64_t pos=img->hdr;
+
+img->nparts=0;
+while (header_fits(buf,size,pos) && (*(uint32_t*)(buf+pos) == 0xa55aaa55)) {
+  memcpy(&hd,buf+pos,sizeof(hd));
+  img->nparts++;
+  pos+=hd.hdsize+hd.psize;
+  img->end=pos;
+  // next header at word boundary from the image start
+  pos=img->base+((pos-img->base+3)&~(uint64_t)3);
+}
+return img->end;
+}
+
+//****************************************************
+//* Chain of the image at hdr passes through header pos
+//****************************************************
+static int chain_reaches(uint8_t* buf, uint64_t size, uint64_t hdr, uint64_t pos) {
+
+struct pheader hd;
+uint64_t base=hdr-prefix_size;
+
+while ((hdr<pos) && header_fits(buf,size,hdr) && (*(uint32_t*)(buf+hdr) == 0xa55aaa55)) {
+  memcpy(&hd,buf+hdr,sizeof(hd));
+  hdr=base+((hdr-base+hd.hdsize+hd.psize+3)&~(uint64_t)3);
+}
+return hdr == pos;
+}
+
+//****************************************************
+//* Search images in the buffer
+//*
+//*  strict - only headers with the right CRC start an image
+//****************************************************
+static int scan_buf(uint8_t* buf, uint64_t size, int strict, struct fwimage** list) {
+
+int64_t pos=0;
+int i,n=0,nweak=0;
+uint64_t weak[max_weak];
+struct fwimage img;
+
+*list=0;
+while ((pos=find_magic(buf,size,pos)) != -1) {
+  if ((pos<prefix_size) || !header_fits(buf,size,pos)) {
+    pos++;
+    continue;
+  }
+  if (strict && !header_valid(buf,size,pos)) {
+    if (nweak<max_weak) weak[nweak++]=pos;
+    pos++;
+    continue;
+  }
+  img.hdr=pos;
+  // damaged headers of the same image in front of it
+  for (i=0;i<nweak;i++) {
+    if (chain_reaches(buf,size,weak[i],pos)) {
+      img.hdr=weak[i];
+      break;
+    }
+  }
+  nweak=0;
+  img.base=img.hdr-prefix_size;
+  img.dload_id=buf[img.base];
+  pos=walk_chain(buf,size,&img);
+  *list=realloc(*list,(n+1)*sizeof(struct fwimage));
+  (*list)[n++]=img;
+}
+return n;
+}
+
+//****************************************************
+//* Find firmware images in a file
+//*
+//*  list - allocated array of images
+//*
+//* returns number of images, -1 - file cannot be read
+//****************************************************
+int scan_images(char* fname, struct fwimage** list) {
+
+uint8_t* buf;
+uint64_t size;
+int n;
+#ifndef WIN32
+int fd;
+struct stat st;
+
+fd=open(fname,O_RDONLY);
+if (fd == -1) return -1;
+if (fstat(fd,&st) != 0) {
+  close(fd);
+  return -1;
+}
+if (st.st_size == 0) {
+  close(fd);
+  return 0;
+}
+size=st.st_size;
+buf=mmap(0,size,PROT_READ,MAP_PRIVATE,fd,0);
+close(fd);
+if (buf == MAP_FAILED) return -1;
+madvise(buf,size,MADV_SEQUENTIAL);
+#else
+HANDLE fh,mh;
+LARGE_INTEGER fsize;
+
+fh=CreateFileA(fname,GENERIC_READ,FILE_SHARE_READ,0,OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,0);
+if (fh == INVALID_HANDLE_VALUE) return -1;
+if (!GetFileSizeEx(fh,&fsize) || (fsize.QuadPart == 0)) {
+  CloseHandle(fh);
+  return 0;
+}
+size=fsize.QuadPart;
+mh=CreateFileMapping(fh,0,PAGE_READONLY,0,0,0);
+CloseHandle(fh);
+if (mh == 0) return -1;
+buf=MapViewOfFile(mh,FILE_MAP_READ,0,0,0);
+CloseHandle(mh);
+if (buf == 0) return -1;
+#endif
+
+n=scan_buf(buf,size,1,list);
+// headers damaged - images are reported by extract() as before
+if (n == 0) n=scan_buf(buf,size,0,list);
+
+#ifndef WIN32
+munmap(buf,size);
+#else
+UnmapViewOfFile(buf);
+#endif
+return n;
+}
+
+//****************************************************
+//* Choose the image of the file to load
+//*
+//* returns header offset of the first partition,
+//*         -1 - no image
+//****************************************************
+int64_t select_image(char* fname) {
+
+struct fwimage* list;
+int i,n,sel;
+int64_t hdr;
+
+n=scan_images(fname,&list);
+if (n <= 0) return -1;
+sel=(image_sel == -1)?0:image_sel;
+if ((n>1) || (image_sel != -1)) {
+  printf("\n Firmware images in %s:\n\n  #   Offset    Partitions       Size  Type",fname);
+  for (i=0;i<n;i++) {
+    printf("\n %s%i  %08llx  %10i  %10llu  %x (%s)",(i == sel)?">":" ",i,(unsigned long long)list[i].base,
+           list[i].nparts,(unsigned long long)(list[i].end-list[i].base),list[i].dload_id,fw_description(list[i].dload_id));
+  }
+  printf("\n");
+}
+if (sel >= n) {
+  printf("\n Image %i is not in the file, use --image 0..%i\n",sel,n-1);
+  exit(1);
+}
+hdr=list[sel].hdr;
+free(list);
+return hdr;
+}
@@ -0,0 +1,14 @@
+// Search for firmware images in a file
+
+struct fwimage {
+  uint64_t base;      // file prefix
+  uint64_t hdr;       // header of the first partition
+  uint64_t end;       // end of the last partition
+  int nparts;
+  uint8_t dload_id;   // firmware type from the prefix
+};
+
+extern int image_sel;
+
+int scan_images(char* fname, struct fwimage** list);
+int64_t select_image(char* fname);
@@ -0,0 +1,147 @@
+//
+//   Session journal for resumable flashing
+//
+//  The journal is a small text file:
+//
+//    device <device identifier>
+//    unit <USB serial number of the unit, - unknown>
+//    firmware <firmware hash>
+//    done <partition #> <partition code>
+//    ...
+//
+//  A "done" line is appended after each partition is closed by the modem.
+//  The file is removed after all partitions have been written.
+//
+//  The device identifier only names the model, so a journal is resumed
+//  automatically only on the unit with the same serial number. When the
+//  serial number is unknown, the partitions to be skipped are listed and
+//  the resume has to be confirmed.
+//
+#include <stdio.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#else
+#include <windows.h>
+#include "printf.h"
+#endif
+
+#include "ptable.h"
+#include "util.h"
+#include "journal.h"
+#include "zlib.h"
+
+// journal file name, 0 - journal disabled
+char* jname=0;
+
+// open journal
+static FILE* jfile=0;
+
+//****************************************************
+//* Firmware hash - covers codes, sizes and contents
+//* of all partitions loaded into the table
+//****************************************************
+uint32_t fw_hash() {
+
+int i;
+uint32_t hash=0;
+
+for (i=0;i<npart;i++) {
+  hash=crc32(hash,(uint8_t*)&ptable[i].hd.code,4);
+  hash=crc32(hash,(uint8_t*)&ptable[i].hd.psize,4);
+  hash=crc32(hash,(uint8_t*)&ptable[i].phash,8);
+}
+return hash;
+}
+
+//****************************************************
+//* Ask whether to resume on a unit that cannot be identified
+//*
+//* returns 1 - resume confirmed
+//****************************************************
+static int confirm_resume(int start) {
+
+char answer[20];
+int i;
+
+printf("\n Journal %s: the serial number of the unit is unknown, it may be another",jname);
+printf("\n device of the same model. Resuming skips these partitions:");
+for (i=0;i<start;i++) printf("\n   %02i  %s",i,ptable[i].pname);
+printf("\n Resume and skip them? (y/N) ");
+fflush(stdout);
+if (fgets(answer,sizeof(answer),stdin) == 0) return 0;
+return (answer[0] == 'y') || (answer[0] == 'Y');
+}
+
+//****************************************************
+//* Open journal and determine restart point
+//*
+//* returns # of the first partition to be written
+//****************************************************
+int journal_start() {
+
+FILE* in;
+char line[200];
+char jdev[100]="";
+char junit[100]="";
+uint32_t jhash=0,hash;
+int part,start=0;
+uint32_t code;
+
+if (jname == 0) return 0;
+hash=fw_hash();
+
+// read journal left by the previous run
+in=fopen(jname,"r");
+if (in != 0) {
+  while (fgets(line,sizeof(line),in) != 0) {
+    if (strncmp(line,"device ",7) == 0) sscanf(line+7,"%99s",jdev);
+    else if (strncmp(line,"unit ",5) == 0) sscanf(line+5,"%99s",junit);
+    else if (strncmp(line,"firmware ",9) == 0) sscanf(line+9,"%x",&jhash);
+    else if (sscanf(line,"done %i %x",&part,&code) == 2) {
+      // partition must be at the same place of the table
+      if ((part >= 0) && (part < npart) && (ptable[part].hd.code == code)) start=part+1;
+    }
+  }
+  fclose(in);
+  if ((dev_id[0] == 0) || (strcmp(jdev,dev_id) != 0) || (jhash != hash)) start=0; // journal of another session
+  else if (start != 0) {
+    if ((unit_id[0] != 0) && (strcmp(junit,unit_id) == 0)) printf("\n Journal %s: partitions 0-%i already written, resuming",jname,start-1);
+    else if ((unit_id[0] != 0) && (junit[0] != 0) && (strcmp(junit,"-") != 0)) start=0; // another unit of the same model
+    else if (!confirm_resume(start)) start=0;
+  }
+}
+
+// write new journal, keeping already completed partitions
+jfile=fopen(jname,"w");
+if (jfile == 0) {
+  printf("\n! Journal file %s cannot be created\n",jname);
+  exit(-1);
+}
+fprintf(jfile,"device %s\nunit %s\nfirmware %08x\n",(dev_id[0] != 0)?dev_id:"-",(unit_id[0] != 0)?unit_id:"-",hash);
+if (start != 0) fprintf(jfile,"done %i %08x\n",start-1,ptable[start-1].hd.code);
+fflush(jfile);
+return start;
+}
+
+//****************************************************
+//* Record successfully written partition
+//****************************************************
+void journal_done(int part) {
+
+if (jfile == 0) return;
+fprintf(jfile,"done %i %08x\n",part,ptable[part].hd.code);
+fflush(jfile);
+}
+
+//****************************************************
+//* Close and remove journal after complete flashing
+//****************************************************
+void journal_finish() {
+
+if (jfile == 0) return;
+fclose(jfile);
+jfile=0;
+remove(jname);
+}
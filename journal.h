@@ -0,0 +1,8 @@
+#include <stdint.h>
+
+extern char* jname;
+
+uint32_t fw_hash();
+int journal_start();
+void journal_done(int part);
+void journal_finish();
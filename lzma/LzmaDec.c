@@ -1099,7 +1099,7 @@ SRes LzmaDecode(Byte *dest, SizeT *destLen, const Byte *src, SizeT *srcLen,
   return res;
 }
 
-int32_t lzma_decode(uint8_t* inbuf,uint32_t fsize,uint8_t* outbuf) {
+int32_t lzma_decode(uint8_t* inbuf,uint32_t fsize,uint8_t* outbuf,uint32_t outmax) {
   SizeT outsize, insize;
   ELzmaStatus status;
   SRes res=0;
@@ -1111,6 +1111,8 @@ int32_t lzma_decode(uint8_t* inbuf,uint32_t fsize,uint8_t* outbuf) {
 // Вынимаем заголовок из буфера
   memcpy(props,inbuf,5);
   memcpy(&outsize,inbuf+5,8);
+  // unknown size is all ones - the buffer size is the limit
+  if (outsize>outmax) outsize=outmax;
   insize=fsize-5-8;
   LzmaDec_Construct(&state);
   RINOK(LzmaDec_Allocate(&state, props, 5, &g_Alloc));
@@ -1118,6 +1120,8 @@ int32_t lzma_decode(uint8_t* inbuf,uint32_t fsize,uint8_t* outbuf) {
   
   res = LzmaDec_DecodeToBuf(&state, outbuf, &outsize,inbuf+5+8, &insize, LZMA_FINISH_ANY, &status);
   LzmaDec_Free(&state, &g_Alloc);
+  // stream does not end within the buffer or the input - damaged data
+  if ((res == 0) && (status != LZMA_STATUS_FINISHED_WITH_MARK) && (status != LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK)) res=SZ_ERROR_DATA;
   if (res == 0) return (int32_t)outsize;
   else return -1;
 }
@@ -0,0 +1,329 @@
+//
+//   Firmware packing
+//
+//  --pack <out.bin> builds a firmware file from a directory of partition
+//  files NN-XXXXXXXX-Name, as written by -e (raw images) or by -s (.fw
+//  files with headers). Files are packed in the order of their numbers,
+//  XXXXXXXX is the partition code.
+//
+//  Headers are rebuilt: checksum blocks with the --blocksize block size,
+//  header CRC. Version, date and time come from the header of a .fw file;
+//  raw images get them from the first .fw file of the directory, or the
+//  current date if there is none. Partitions listed in --compress are
+//  stored zlib compressed, in the format extract() detects, unless they
+//  unpack to more than extract() accepts (zlib_max). The Windows
+//  build has only the inflate side of zlib and stores all partitions as
+//  they are.
+//
+//  The digital signature is at the end of the image of one of the first
+//  partitions; the images are copied as they are, so the signature is
+//  preserved and the firmware type in the file prefix gets the signed bit.
+//
+//  Files are read one by one. Each image to compress is deflated on all
+//  cores (compress.c), then the checksums are built on a pool of threads,
+//  one partition at a time per thread.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#else
+#include <windows.h>
+#include "printf.h"
+#endif
+
+#include "ptable.h"
+#include "signver.h"
+#include "arena.h"
+#include "trace.h"
+#ifndef WIN32
+#include "compress.h"
+#endif
+#include "pack.h"
+
+// output file, 0 - no packing
+char* packname=0;
+// checksum block size, 0 - from the .fw files or 4096
+uint32_t pack_blocksize=0;
+// partitions to compress, 0 - none
+char* pack_zlist=0;
+
+// partitions processed at the same time
+#define pack_threads 4
+
+static volatile int32_t pack_next;
+static int pack_first;
+
+#ifndef WIN32
+#define pack_inc() __sync_fetch_and_add(&pack_next,1)
+#else
+#define pack_inc() (InterlockedIncrement((LONG volatile*)&pack_next)-1)
+#endif
+
+//****************************************************
+//* Image is already compressed
+//****************************************************
+static int is_compressed(int n) {
+
+if ((ptable[n].hd.psize >= 2) && (*(uint16_t*)ptable[n].pimage == 0xda78)) return 1;
+if ((ptable[n].hd.psize >= 13) && (ptable[n].pimage[0] == 0x5d) && (*(uint64_t*)(ptable[n].pimage+5) == 0xffffffffffffffff)) return 1;
+return 0;
+}
+
+//****************************************************
+//* Compress the image if it is listed in --compress
+//****************************************************
+static void pack_compress(int n) {
+
+#ifndef WIN32
+uint8_t* zbuf;
+uint32_t zlen;
+
+if ((pack_zlist == 0) || !part_in_list(pack_zlist,ptable[n].hd.code,ptable[n].pname) || is_compressed(n)) return;
+if (ptable[n].hd.psize>zlib_max) {
+  // extract() would not be able to unpack it
+  printf("\n Partition %s is larger than %i MB, stored uncompressed",ptable[n].pname,zlib_max/1024/1024);
+  return;
+}
+zlen=zlib_pack(ptable[n].pimage,ptable[n].hd.psize,&zbuf);
+if ((zlen == 0) || (zlen >= ptable[n].hd.psize)) {
+  // nothing gained
+  free(zbuf);
+  return;
+}
+ptable[n].zflag=ptable[n].hd.psize;
+ptable[n].pimage=zbuf;
+ptable[n].hd.psize=zlen;
+ptable[n].ztype='Z';
+#endif
+}
+
+//****************************************************
+//* Build the checksum block of the image
+//****************************************************
+static void pack_part(int n) {
+
+ptable[n].csumblock=malloc(csum_words(n)*2);
+fill_crc16(n,ptable[n].csumblock);
+}
+
+//****************************************************
+//* Pack worker
+//****************************************************
+#ifndef WIN32
+static void* pack_worker(void* arg) {
+#else
+static DWORD WINAPI pack_worker(LPVOID arg) {
+#endif
+
+int n;
+
+while ((n=pack_inc()+pack_first) < npart) pack_part(n);
+return 0;
+}
+
+//****************************************************
+//* Load partition file
+//*
+//* A .fw file keeps its header fields, the image
+//* follows the header and checksum block.
+//*
+//* returns 0 - error
+//****************************************************
+static int pack_load(struct pfile* pf, struct pheader* tmpl, int* havetmpl) {
+
+FILE* in;
+uint8_t* buf;
+struct pheader* fh;
+int n=npart;
+
+ptable_add();
+ptable[n].hd.code=pf->code;
+find_pname(pf->code,ptable[n].pname);
+if (!part_selected(ptable[n].hd.code,ptable[n].pname)) return 1; // excluded by --only/--skip
+
+buf=arena_alloc(pf->size);
+in=fopen(pf->fname,"rb");
+if (in == 0) {
+  printf("\n Error opening file %s\n",pf->fname);
+  return 0;
+}
+if (fread(buf,1,pf->size,in) != pf->size) {
+  printf("\n Error reading file %s\n",pf->fname);
+  fclose(in);
+  return 0;
+}
+fclose(in);
+
+fh=(struct pheader*)buf;
+if ((pf->size >= sizeof(struct pheader)) && ((uint32_t)fh->magic == 0xa55aaa55)) {
+  // .fw file
+  if ((fh->hdsize<sizeof(struct pheader)) || (fh->hdsize>pf->size) || (fh->psize>pf->size-fh->hdsize)) {
+    printf("\n File %s has an incorrect header\n",pf->fname);
+    return 0;
+  }
+  memcpy(&ptable[n].hd,fh,sizeof(struct pheader));
+  ptable[n].pimage=buf+fh->hdsize;
+  if (!*havetmpl) {
+    memcpy(tmpl,fh,sizeof(struct pheader));
+    *havetmpl=1;
+  }
+}
+else {
+  // raw image, header fields are filled in later
+  ptable[n].hd.magic=0;
+  ptable[n].hd.psize=pf->size;
+  ptable[n].pimage=buf;
+}
+ptable[n].hd.code=pf->code;
+ptable[n].fname=pf->fname;
+ptable[n].ztype=' ';
+npart++;
+return 1;
+}
+
+//****************************************************
+//* Default header of raw images - current date
+//****************************************************
+static void default_header(struct pheader* tmpl) {
+
+time_t t;
+struct tm* tm;
+
+memset(tmpl,0,sizeof(struct pheader));
+time(&t);
+tm=localtime(&t);
+strftime((char*)tmpl->date,sizeof(tmpl->date),"%Y.%m.%d",tm);
+strftime((char*)tmpl->time,sizeof(tmpl->time),"%H:%M:%S",tm);
+tmpl->blocksize=4096;
+}
+
+//****************************************************
+//* Build firmware file from a directory
+//****************************************************
+int pack_fw(char* fdir) {
+
+struct pfile* pf;
+struct pheader tmpl;
+int havetmpl=0;
+int i,nf,nt,res=0;
+int32_t signsize;
+uint8_t prefix[0x5c];
+uint8_t pad[4]={0};
+uint32_t pos,code,size;
+FILE* out;
+#ifndef WIN32
+pthread_t th[pack_threads];
+#else
+HANDLE th[pack_threads];
+#endif
+
+if (!dflag) {
+  printf("\n Firmware type for --pack is not set, use -d\n");
+  return -1;
+}
+
+// load files
+nf=index_files(fdir,&pf);
+pack_first=npart;
+trace_begin("io","read %i files",nf);
+for (i=0;i<nf;i++) {
+  if (!pack_load(&pf[i],&tmpl,&havetmpl)) return -1;
+}
+trace_end("io");
+if (npart == pack_first) {
+  printf("\n No partitions selected for packing\n");
+  return -1;
+}
+if (!havetmpl) default_header(&tmpl);
+if (pack_blocksize != 0) tmpl.blocksize=pack_blocksize;
+
+// headers of raw images are made from the template
+for (i=pack_first;i<npart;i++) {
+  if ((uint32_t)ptable[i].hd.magic != 0xa55aaa55) {
+    code=ptable[i].hd.code;
+    size=ptable[i].hd.psize;
+    memcpy(&ptable[i].hd,&tmpl,sizeof(struct pheader));
+    ptable[i].hd.magic=0xa55aaa55;
+    ptable[i].hd.code=code;
+    ptable[i].hd.psize=size;
+  }
+  if (pack_blocksize != 0) ptable[i].hd.blocksize=pack_blocksize;
+  if (ptable[i].hd.blocksize == 0) ptable[i].hd.blocksize=tmpl.blocksize?tmpl.blocksize:4096;
+}
+
+// signature - before the images are compressed
+signsize=serach_sign(pack_first);
+
+// compression, every image on all cores
+trace_begin("decode","compress");
+for (i=pack_first;i<npart;i++) pack_compress(i);
+trace_end("decode");
+
+// checksums
+trace_begin("decode","checksums of %i partitions",npart-pack_first);
+pack_next=0;
+nt=(npart-pack_first<pack_threads)?npart-pack_first:pack_threads;
+for (i=0;i<nt;i++) {
+#ifndef WIN32
+  if (pthread_create(&th[i],0,pack_worker,0) != 0) break;
+#else
+  th[i]=CreateThread(0,0,pack_worker,0,0,0);
+  if (th[i] == 0) break;
+#endif
+}
+nt=i;
+// the partitions left are processed here
+pack_worker(0);
+for (i=0;i<nt;i++) {
+#ifndef WIN32
+  pthread_join(th[i],0);
+#else
+  WaitForSingleObject(th[i],INFINITE);
+  CloseHandle(th[i]);
+#endif
+}
+trace_end("decode");
+
+// write the file
+out=fopen(packname,"wb");
+if (out == 0) {
+  printf("\n File %s cannot be created\n",packname);
+  return -1;
+}
+memset(prefix,0,sizeof(prefix));
+prefix[0]=dload_id|((signsize != -1)?8:0);
+fwrite(prefix,1,sizeof(prefix),out);
+pos=sizeof(prefix);
+
+printf("\n Packing %s:\n\n ## Offset    Size      Compression     Name\n-----------------------------------------------",packname);
+for (i=pack_first;i<npart;i++) {
+  ptable[i].offset=pos;
+  printf("\n %02i %08x %8i",i-pack_first,pos,ptable[i].hd.psize);
+  if (ptable[i].ztype == 'Z') printf("  Zlib %3i%%",ptable[i].hd.psize*100/ptable[i].zflag);
+  else printf("           ");
+  printf("   %s",ptable[i].pname);
+  fwrite(&ptable[i].hd,1,sizeof(struct pheader),out);
+  fwrite(ptable[i].csumblock,1,ptable[i].hd.hdsize-sizeof(struct pheader),out);
+  fwrite(ptable[i].pimage,1,ptable[i].hd.psize,out);
+  pos+=ptable[i].hd.hdsize+ptable[i].hd.psize;
+  // partitions start at word boundary
+  if ((pos&3) != 0) {
+    fwrite(pad,1,4-(pos&3),out);
+    pos=(pos+3)&~3;
+  }
+}
+if (fclose(out) != 0) res=-1;
+if (res == 0) {
+  printf("\n\n Firmware type: %x (%s), ",prefix[0],fw_description(prefix[0]));
+  if (signsize == -1) printf("no digital signature");
+  else printf("digital signature %i bytes",signsize);
+  printf("\n %u bytes written\n",pos);
+}
+else printf("\n! Write error %s\n",packname);
+free(pf);
+return res;
+}
@@ -0,0 +1,5 @@
+extern char* packname;
+extern uint32_t pack_blocksize;
+extern char* pack_zlist;
+
+int pack_fw(char* fdir);
@@ -0,0 +1,293 @@
+//
+//   Flashing progress reporter
+//
+//  The transmit loop only stores counters into a shared state; a separate
+//  reporter thread renders them every progress_tick_ms. The console line
+//  is redrawn only when the percentage changes, so a slow console or a
+//  logged ssh session does not slow down the transfer.
+//
+//  With --progress-fd <n> the reporter also writes newline-delimited JSON
+//  to file descriptor n, one object per line:
+//
+//    {"event": "session", "port": ...}
+//    {"event": "progress", "port": ..., "partition": 3, "name": "Kernel", "bytes": ...,
+//     "size": ..., "total_bytes": ..., "total_size": ..., "mbps": ..., "eta_s": ...}
+//    {"event": "partition", "port": ..., "partition": 3, "name": "Kernel", "size": ..., "seconds": ...}
+//    {"event": "done", "port": ..., ...} or {"event": "failed", "port": ...}
+//
+//  Every event carries the port, so the stream of a flash station, where
+//  all sessions share the descriptor, can be split per device. Partition
+//  and final events are written by the flashing thread, progress events by
+//  the reporter at most every progress_json_ms.
+//
+#include <stdio.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#else
+#include <windows.h>
+#include <io.h>
+#include "printf.h"
+#endif
+
+#include "hdlcio.h"
+#include "ptable.h"
+#include "util.h"
+#include "progress.h"
+
+// JSON stream descriptor, -1 - disabled
+int progress_fd=-1;
+
+// console redraw period and JSON event period, ms
+#define progress_tick_ms 100
+#define progress_json_ms 500
+
+static FILE* pjson=0;
+
+// state shared with the reporter
+static volatile int32_t ppart=-1;      // partition being written, -1 - none
+static volatile uint32_t pbytes=0;     // bytes of the partition sent
+static volatile uint32_t pplen=0;      // partition size
+static volatile uint32_t tbytes=0;     // bytes of finished partitions
+static volatile uint32_t tsize=0;      // bytes to be written in the session
+static volatile int prun=0;            // reporter is running
+
+static uint64_t tstart;                // start of the partition loop
+static uint64_t pstart;                // partition start
+static int shown=-1;                   // percentage on the console
+static int psession=0;                 // session started
+static int pfinished=0;                // final event written
+static char pport[64]="";
+
+#ifndef WIN32
+static pthread_t rthread;
+static pthread_mutex_t plock=PTHREAD_MUTEX_INITIALIZER;
+#define plock_take() pthread_mutex_lock(&plock)
+#define plock_give() pthread_mutex_unlock(&plock)
+#else
+static HANDLE rthread;
+static CRITICAL_SECTION plock;
+#define plock_take() EnterCriticalSection(&plock)
+#define plock_give() LeaveCriticalSection(&plock)
+#endif
+
+//****************************************************
+//* Console line of the current partition, under plock
+//****************************************************
+static void show_line(int force) {
+
+int pc;
+
+if (ppart<0) return;
+pc=pplen?(uint64_t)pbytes*100/pplen:100;
+if ((pc == shown) && !force) return;
+shown=pc;
+printf("\r%02i  %-20s  %i%%",ppart,ptable[ppart].pname,pc);
+fflush(stdout);
+}
+
+//****************************************************
+//* JSON progress event, under plock
+//****************************************************
+static void json_progress() {
+
+uint64_t us;
+uint32_t done;
+double rate;
+
+if ((pjson == 0) || (ppart<0)) return;
+us=now_us()-tstart;
+done=tbytes+pbytes;
+rate=us?(double)done/us:0;   // bytes per us = MB/s
+fprintf(pjson,"{\"event\": \"progress\", \"port\": ");
+json_string(pjson,pport);
+fprintf(pjson,", \"partition\": %i, \"name\": ",ppart);
+json_string(pjson,ptable[ppart].pname);
+fprintf(pjson,", \"bytes\": %u, \"size\": %u, \"total_bytes\": %u, \"total_size\": %u, \"mbps\": %.3f, \"eta_s\": %.1f}\n",
+        pbytes,pplen,done,tsize,rate,(rate>0)?(tsize-done)/rate/1e6:0.0);
+fflush(pjson);
+}
+
+//****************************************************
+//* Reporter thread
+//****************************************************
+#ifndef WIN32
+static void* reporter(void* arg) {
+#else
+static DWORD WINAPI reporter(LPVOID arg) {
+#endif
+
+int ticks=0;
+
+while (prun) {
+  usleep(progress_tick_ms*1000);
+  plock_take();
+  if (prun) {
+    show_line(0);
+    if (++ticks >= progress_json_ms/progress_tick_ms) {
+      json_progress();
+      ticks=0;
+    }
+  }
+  plock_give();
+}
+return 0;
+}
+
+//****************************************************
+//* Final event if the program exits during flashing
+//****************************************************
+static void progress_exit() {
+
+if ((pjson == 0) || !psession || pfinished) return;
+plock_take();
+fprintf(pjson,"{\"event\": \"failed\", \"port\": ");
+json_string(pjson,pport);
+fprintf(pjson,"}\n");
+fflush(pjson);
+plock_give();
+}
+
+//****************************************************
+//* Open the JSON stream
+//****************************************************
+void progress_init() {
+
+#ifdef WIN32
+InitializeCriticalSection(&plock);
+#endif
+if (progress_fd == -1) return;
+#ifndef WIN32
+pjson=fdopen(progress_fd,"w");
+#else
+pjson=_fdopen(progress_fd,"w");
+#endif
+if (pjson == 0) {
+  printf("\n Progress descriptor %i cannot be opened\n",progress_fd);
+  exit(-1);
+}
+atexit(progress_exit);
+}
+
+//****************************************************
+//* Session start
+//****************************************************
+void progress_session(char* port) {
+
+strncpy(pport,port,sizeof(pport)-1);
+psession=1;
+if (pjson == 0) return;
+plock_take();
+fprintf(pjson,"{\"event\": \"session\", \"port\": ");
+json_string(pjson,port);
+fprintf(pjson,"}\n");
+fflush(pjson);
+plock_give();
+}
+
+//****************************************************
+//* Start of the partition loop
+//*
+//*  total - bytes to be written in the session
+//****************************************************
+void progress_start(uint32_t total) {
+
+tsize=total;
+tbytes=0;
+ppart=-1;
+tstart=now_us();
+prun=1;
+#ifndef WIN32
+if (pthread_create(&rthread,0,reporter,0) != 0) prun=0;
+#else
+rthread=CreateThread(0,0,reporter,0,0,0);
+if (rthread == 0) prun=0;
+#endif
+}
+
+//****************************************************
+//* Partition skipped - not written in this session
+//****************************************************
+void progress_skip(uint32_t size) {
+
+tsize-=size;
+}
+
+//****************************************************
+//* Partition write started
+//****************************************************
+void progress_part(int part) {
+
+plock_take();
+pbytes=0;
+pplen=ptable[part].hd.psize;
+ppart=part;
+shown=-1;
+pstart=now_us();
+show_line(1);
+plock_give();
+}
+
+//****************************************************
+//* Block sent - the only call in the transmit loop
+//****************************************************
+void progress_block(uint32_t bytes) {
+
+pbytes+=bytes;
+}
+
+//****************************************************
+//* Partition finished or failed
+//*
+//* The console line is brought up to date, the partition
+//* is no longer drawn by the reporter.
+//****************************************************
+void progress_part_end(int ok) {
+
+plock_take();
+if (ppart >= 0) {
+  show_line(0);
+  if (ok && (pjson != 0)) {
+    fprintf(pjson,"{\"event\": \"partition\", \"port\": ");
+    json_string(pjson,pport);
+    fprintf(pjson,", \"partition\": %i, \"name\": ",ppart);
+    json_string(pjson,ptable[ppart].pname);
+    fprintf(pjson,", \"size\": %u, \"seconds\": %.3f}\n",pplen,(now_us()-pstart)/1e6);
+    fflush(pjson);
+  }
+  if (ok) tbytes+=pplen;
+}
+ppart=-1;
+plock_give();
+}
+
+//****************************************************
+//* End of the partition loop
+//****************************************************
+void progress_stop() {
+
+if (!prun) return;
+prun=0;
+#ifndef WIN32
+pthread_join(rthread,0);
+#else
+WaitForSingleObject(rthread,INFINITE);
+CloseHandle(rthread);
+#endif
+}
+
+//****************************************************
+//* Session completed
+//****************************************************
+void progress_finish() {
+
+pfinished=1;
+if (pjson == 0) return;
+fprintf(pjson,"{\"event\": \"done\", \"port\": ");
+json_string(pjson,pport);
+fprintf(pjson,", \"total_size\": %u, \"seconds\": %.3f}\n",tsize,tstart?(now_us()-tstart)/1e6:0.0);
+fflush(pjson);
+}
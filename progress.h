@@ -0,0 +1,11 @@
+extern int progress_fd;
+
+void progress_init();
+void progress_session(char* port);
+void progress_start(uint32_t total);
+void progress_skip(uint32_t size);
+void progress_part(int part);
+void progress_block(uint32_t bytes);
+void progress_part_end(int ok);
+void progress_stop();
+void progress_finish();
@@ -5,6 +5,7 @@
 #ifndef WIN32
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #else
 #include <windows.h>
 #include "printf.h"
@@ -16,17 +17,55 @@
 #include "hdlcio.h"
 #include "util.h"
 #include "signver.h"
+#include "trace.h"
+#include "arena.h"
+#include "imgscan.h"
 
-int32_t lzma_decode(uint8_t* inbuf,uint32_t fsize,uint8_t* outbuf);
+int32_t lzma_decode(uint8_t* inbuf,uint32_t fsize,uint8_t* outbuf,uint32_t outmax);
+
+#ifdef WIN32
+#define strcasecmp _stricmp
+#endif
+
+// partition selection lists (--only, --skip), 0 - not specified
+static char* only_list=0;
+static char* skip_list=0;
+
+// allocated entries of the partition table
+static int ptcap=0;
+
+// firmware file being loaded
+static char* srcname=0;
+
+// offset of the loaded image in the file, partitions are aligned from it
+static long fwbase=0;
 
 //******************************************************
-//*  search for partition symbolic name by its code
+//*  Prepare the next free entry of the partition table
+//*
+//* The table grows as needed; the entry ptable[npart] is
+//* cleared, it becomes part of the table with npart++.
+//* Pointers into the table are invalid after this call.
 //******************************************************
+struct ptb_t* ptable_add() {
 
-void  find_pname(unsigned int id,unsigned char* pname) {
+struct ptb_t* nt;
 
-unsigned int j;
-struct {
+if (npart == ptcap) {
+  nt=realloc(ptable,(ptcap?ptcap*2:16)*sizeof(struct ptb_t));
+  if (nt == 0) {
+    printf("\n! Memory allocation error, partition table of %i entries\n",ptcap*2);
+    exit(1);
+  }
+  ptable=nt;
+  ptcap=ptcap?ptcap*2:16;
+}
+memset(&ptable[npart],0,sizeof(struct ptb_t));
+return &ptable[npart];
+}
+
+// partition codes and names
+static struct {
   char name[20];
   int code;
 } pcodes[]={ 
@@ -85,6 +124,14 @@ struct {
   {0,0}
 };
 
+//******************************************************
+//*  search for partition symbolic name by its code
+//******************************************************
+
+void  find_pname(unsigned int id,unsigned char* pname) {
+
+unsigned int j;
+
 for(j=0;pcodes[j].code != 0;j++) {
   if(pcodes[j].code == id) break;
 }
@@ -92,6 +139,95 @@ if (pcodes[j].code != 0) strcpy(pname,pcodes[j].name); // name found - copy it t
 else sprintf(pname,"U%08x",id); // name not found - substitute pseudo-name Uxxxxxxxx in big-endian format
 }
 
+//*******************************************************************
+//*  Check whether list item names a partition: known name,
+//*  pseudo-name Uxxxxxxxx or hex code
+//*******************************************************************
+static int known_item(char* item) {
+
+char* end;
+int j;
+
+for(j=0;pcodes[j].code != 0;j++) {
+  if (strcasecmp(item,pcodes[j].name) == 0) return 1;
+}
+if (((item[0] == 'U') || (item[0] == 'u')) && (strlen(item) == 9)) item++;
+strtoul(item,&end,16);
+return (*item != 0) && (*end == 0);
+}
+
+//*******************************************************************
+//*  Set partition selection list
+//*
+//*  list - comma-separated partition names or hex codes (WEBUI,APP,0x590000)
+//*  skip - 0 for --only, 1 for --skip
+//*
+//* returns 0 - ok, -1 - list has unknown partitions
+//*******************************************************************
+int part_filter(char* list, int skip) {
+
+char item[40];
+char* p;
+int len,res=0;
+
+for (p=list;*p != 0;) {
+  len=strcspn(p,",");
+  if (len != 0) {
+    item[0]=0;
+    if (len<sizeof(item)) {
+      memcpy(item,p,len);
+      item[len]=0;
+    }
+    if (!known_item(item)) {
+      printf("\n Unknown partition %.*s in --%s list",len,p,skip?"skip":"only");
+      res=-1;
+    }
+  }
+  p+=len;
+  if (*p == ',') p++;
+}
+if (res != 0) {
+  printf("\n Partitions are given by name or hex code, e.g. WEBUI,APP,590000\n");
+  return -1;
+}
+if (skip) skip_list=list;
+else only_list=list;
+return 0;
+}
+
+//*******************************************************************
+//*  Check whether partition is present in the selection list
+//*******************************************************************
+int part_in_list(char* list, uint32_t code, unsigned char* pname) {
+
+char item[40];
+char* end;
+int len;
+
+while (*list != 0) {
+  len=strcspn(list,",");
+  if (len<sizeof(item)) {
+    memcpy(item,list,len);
+    item[len]=0;
+    if (strcasecmp(item,pname) == 0) return 1;               // symbolic name
+    if ((len != 0) && (strtoul(item,&end,16) == code) && (*end == 0)) return 1; // partition code
+  }
+  list+=len;
+  if (*list == ',') list++;
+}
+return 0;
+}
+
+//*******************************************************************
+//*  Check whether partition is selected for processing
+//*******************************************************************
+int part_selected(uint32_t code, unsigned char* pname) {
+
+if ((only_list != 0) && !part_in_list(only_list,code,pname)) return 0;
+if ((skip_list != 0) && part_in_list(skip_list,code,pname)) return 0;
+return 1;
+}
+
 //*******************************************************************
 // Calculate checksum block size for partition
 //*******************************************************************
@@ -119,20 +255,31 @@ ptable[n].hd.crc=crc16((uint8_t*)&ptable[n].hd,sizeof(struct pheader));
 
 
 //*******************************************************
-//*  Calculate block checksum of partition 
+//*  Checksum block size of partition in 16-bit words
+//*******************************************************
+uint32_t csum_words(int n) {
+
+uint32_t csize;
+
+csize=psize(n)/ptable[n].hd.blocksize;
+if (psize(n)%ptable[n].hd.blocksize != 0) csize++; // This is if image size is not a multiple of blocksize
+return csize;
+}
+
+//*******************************************************
+//*  Calculate block checksum of partition into csblock
+//*
+//* csblock - csum_words(n) words, does not allocate
+//* memory and can run in several threads
 //*******************************************************
-void calc_crc16(int n) {
+void fill_crc16(int n, uint16_t* csblock) {
   
 uint32_t csize; // checksum block size in 16-bit words
-uint16_t* csblock;  // pointer to created block
 uint32_t off,len;
 uint32_t i;
 uint32_t blocksize=ptable[n].hd.blocksize; // block size covered by checksum
 
-// determine size and create block
-csize=psize(n)/blocksize;
-if (psize(n)%blocksize != 0) csize++; // This is if image size is not a multiple of blocksize
-csblock=(uint16_t*)malloc(csize*2);
+csize=csum_words(n);
 
 // checksum calculation loop
 for (i=0;i<csize;i++) {
@@ -141,8 +288,7 @@ for (i=0;i<csize;i++) {
  if ((ptable[n].hd.psize-off)<blocksize) len=ptable[n].hd.psize-off; // for last incomplete block 
  csblock[i]=crc16(ptable[n].pimage+off,len);
 } 
-// write parameters to header
-if (ptable[n].csumblock != 0) free(ptable[n].csumblock); // destroy old block if it existed
+// write parameters to header, the old block stays in the arena
 ptable[n].csumblock=csblock;
 ptable[n].hd.hdsize=csize*2+sizeof(struct pheader);
 // recalculate header CRC
@@ -151,6 +297,172 @@ calc_hd_crc16(n);
 }
 
 
+//*******************************************************
+//*  Calculate content hash of partition image
+//*******************************************************
+void calc_phash(int n) {
+
+uint32_t c,a;
+
+c=crc32(0,ptable[n].pimage,ptable[n].hd.psize);
+a=adler32(1,ptable[n].pimage,ptable[n].hd.psize);
+ptable[n].phash=((uint64_t)c<<32)|a;
+}
+
+
+//-------------------------------------------------------
+//  Loading with checksums on the fly
+//
+//  Every block of the image is checksummed right after it is read or
+//  decompressed, while it is still in the cache: block CRC16 (checked
+//  against the loaded checksum block and/or stored as the new one) and
+//  the content hash. zlib images are inflated straight from the file
+//  into their place in the arena, the compressed image is never stored.
+//-------------------------------------------------------
+
+// bytes read from the file at once, rounded down to whole blocks
+#define piece_size (256*1024)
+
+// decompression buffers, zlib_max is in ptable.h
+#define lzma_max (100*1024*1024)
+
+// running checksums of an image that arrives in pieces
+struct isum {
+  uint32_t blocksize;
+  uint32_t done;       // bytes summed
+  uint32_t nblk;       // blocks summed
+  uint16_t* cs;        // block checksums to fill, 0 - not kept
+  uint16_t* ref;       // expected block checksums, 0 - not checked
+  uint32_t bad;        // blocks that differ from ref
+  int hash;            // calculate content hash
+  uint32_t crc,adler;
+};
+
+// compressed data being read and checksums of the decompressed image
+static uint8_t* zpiece=0;
+static uint32_t zpiece_size=0;
+static uint16_t* zcs=0;
+static uint32_t zcs_size=0;
+
+//*******************************************************
+//*  Prepare running checksums
+//*******************************************************
+static void isum_init(struct isum* s, uint32_t blocksize, uint16_t* cs, uint16_t* ref, int hash) {
+
+memset(s,0,sizeof(struct isum));
+s->blocksize=blocksize;
+s->cs=cs;
+s->ref=ref;
+s->hash=hash;
+s->crc=crc32(0,0,0);
+s->adler=adler32(0,0,0);
+}
+
+//*******************************************************
+//*  Checksum the next bytes of the image
+//*
+//* Only whole blocks are taken unless final is set,
+//* the rest has to be passed again with the next bytes.
+//*******************************************************
+static void isum_update(struct isum* s, uint8_t* p, uint32_t len, int final) {
+
+uint32_t blen;
+uint16_t c;
+
+while (len>0) {
+  blen=(len<s->blocksize)?len:s->blocksize;
+  if ((blen<s->blocksize) && !final) break;
+  c=crc16(p,blen);
+  if (s->cs != 0) s->cs[s->nblk]=c;
+  if ((s->ref != 0) && (s->ref[s->nblk] != c)) s->bad++;
+  if (s->hash) {
+    s->crc=crc32(s->crc,p,blen);
+    s->adler=adler32(s->adler,p,blen);
+  }
+  s->nblk++;
+  s->done+=blen;
+  p+=blen;
+  len-=blen;
+}
+}
+
+//*******************************************************
+//*  Install the new checksum block of the partition
+//*******************************************************
+static void set_csum(int n, uint16_t* cs, struct isum* s) {
+
+ptable[n].csumblock=cs;
+ptable[n].hd.hdsize=s->nblk*2+sizeof(struct pheader);
+calc_hd_crc16(n);
+if (s->hash) ptable[n].phash=((uint64_t)s->crc<<32)|s->adler;
+}
+
+//*******************************************************
+//*  Read image from the file with running checksums
+//*
+//* returns bytes read
+//*******************************************************
+static uint32_t read_summed(FILE* in, uint8_t* buf, uint32_t len, struct isum* s) {
+
+uint32_t piece,off,got,n;
+
+piece=piece_size-piece_size%s->blocksize;
+if (piece == 0) piece=s->blocksize;
+for (off=0;off<len;off+=got) {
+  n=(len-off<piece)?len-off:piece;
+  got=fread(buf+off,1,n,in);
+  isum_update(s,buf+off,got,(got<n) || (off+got == len));
+  if (got<n) return off+got;
+}
+return len;
+}
+
+//*******************************************************
+//*  Inflate zlib image from the file into the arena
+//*
+//* The compressed data is checked against the loaded
+//* checksum block (zs) while it is read, the output is
+//* checksummed (os) as it is produced.
+//*
+//* returns decompressed size, -1 - error
+//*******************************************************
+static long inflate_summed(FILE* in, uint32_t len, uint8_t* out, struct isum* zs, struct isum* os) {
+
+z_stream strm;
+uint32_t piece,off,n,got;
+int res=Z_OK;
+
+piece=piece_size-piece_size%zs->blocksize;
+if (piece == 0) piece=zs->blocksize;
+if (zpiece_size<piece) {
+  zpiece=realloc(zpiece,piece);
+  zpiece_size=piece;
+}
+memset(&strm,0,sizeof(strm));
+if (inflateInit(&strm) != Z_OK) return -1;
+strm.next_out=out;
+strm.avail_out=zlib_max;
+for (off=0;off<len;off+=n) {
+  n=(len-off<piece)?len-off:piece;
+  got=fread(zpiece,1,n,in);
+  isum_update(zs,zpiece,got,(got<n) || (off+n == len));
+  if (got<n) res=Z_DATA_ERROR;
+  if (res == Z_OK) {
+    strm.next_in=zpiece;
+    strm.avail_in=got;
+    while ((strm.avail_in != 0) && (res == Z_OK)) {
+      res=inflate(&strm,Z_NO_FLUSH);
+      if ((res == Z_OK) && (strm.avail_out == 0)) res=Z_BUF_ERROR;  // does not fit the buffer
+      isum_update(os,out+os->done,strm.total_out-os->done,res == Z_STREAM_END);
+    }
+  }
+  if (got<n) break;
+}
+inflateEnd(&strm);
+if (res != Z_STREAM_END) return -1;
+return strm.total_out;
+}
+
 //*******************************************************************
 //* Extract partition from file and add it to partition table
 //*
@@ -161,11 +473,16 @@ void extract(FILE* in)  {
 
 uint16_t hcrc,crc;
 uint16_t* crcblock;
-uint32_t crcblocksize;
+uint16_t* cs;
+uint32_t crcblocksize,nwords,bsize;
+uint8_t sig[13];
 uint8_t* zbuf;
 long int zlen;
-int res;
+int res,siglen,ztype=' ';
+struct isum rs,os;
 
+ptable_add();
+ptable[npart].fname=srcname;
 ptable[npart].zflag=0; 
 // read header into structure
 ptable[npart].offset=ftell(in);
@@ -173,15 +490,19 @@ fread(&ptable[npart].hd,1,sizeof(struct pheader),in); // header
 //  Search for partition symbolic name in table 
 find_pname(ptable[npart].hd.code,ptable[npart].pname);
 
+// partition excluded by --only/--skip - step over its body without loading it
+if (!part_selected(ptable[npart].hd.code,ptable[npart].pname)) {
+  fseek(in,crcsize(npart)+psize(npart),SEEK_CUR);
+  goto align;
+}  
+
 // load checksum block
+trace_begin("io","read %s",ptable[npart].pname);
 ptable[npart].csumblock=0;  // block not created yet
-crcblock=(uint16_t*)malloc(crcsize(npart)); // allocate temporary memory for loaded block
+crcblock=(uint16_t*)arena_alloc(crcsize(npart)); // memory for loaded block
 crcblocksize=crcsize(npart);
 fread(crcblock,1,crcblocksize,in);
-
-// load partition image
-ptable[npart].pimage=(uint8_t*)malloc(psize(npart));
-fread(ptable[npart].pimage,1,psize(npart),in);
+ptable[npart].doffset=ptable[npart].offset+sizeof(struct pheader)+crcblocksize;
 
 // check header CRC
 hcrc=ptable[npart].hd.crc;
@@ -193,117 +514,175 @@ if (crc != hcrc) {
 }  
 ptable[npart].hd.crc=crc;  // restore CRC
 
-// calculate and check partition CRC
-calc_crc16(npart);
-if (crcblocksize != crcsize(npart)) {
+// the loaded checksum block is checked only if its size is right
+nwords=csum_words(npart);
+if (crcblocksize != nwords*2) {
     printf("\n! Partition %s (%02x) - incorrect checksum block size",ptable[npart].pname,ptable[npart].hd.code>>16);
     errflag=1;
 }    
-  
-else if (memcmp(crcblock,ptable[npart].csumblock,crcblocksize) != 0) {
-    printf("\n! Partition %s (%02x) - incorrect block checksum",ptable[npart].pname,ptable[npart].hd.code>>16);
-    errflag=1;
-}  
-  
-free(crcblock);
-
 
+// Detect compression by the beginning of the image
+siglen=(psize(npart)<sizeof(sig))?psize(npart):sizeof(sig);
+siglen=fread(sig,1,siglen,in);
+fseek(in,-siglen,SEEK_CUR);
+if ((siglen >= 2) && (*(uint16_t*)sig == 0xda78)) ztype='Z';
+if ((siglen == sizeof(sig)) && (sig[0] == 0x5d) && (*(uint64_t*)(sig+5) == 0xffffffffffffffff)) ztype='L';
 ptable[npart].ztype=' ';
-// Detect zlib compression
-
+bsize=ptable[npart].hd.blocksize;
 
-if ((*(uint16_t*)ptable[npart].pimage) == 0xda78) {
+if (ztype == 'Z') {
+  // zlib: inflated from the file with checksums of both streams
+  trace_begin("decode","zlib %s",ptable[npart].pname);
   ptable[npart].zflag=ptable[npart].hd.psize;  // save compressed size 
-  zlen=52428800;
-  zbuf=malloc(zlen);  // 50M buffer
-  // decompress partition image
-  res=uncompress (zbuf, &zlen, ptable[npart].pimage, ptable[npart].hd.psize);
-  if (res != Z_OK) {
+  if (zcs_size<zlib_max/bsize+1) {
+    zcs_size=zlib_max/bsize+1;
+    zcs=realloc(zcs,zcs_size*2);
+  }
+  zbuf=arena_scratch(zlib_max);  // 50M at the top of the arena
+  isum_init(&rs,bsize,0,(crcblocksize == nwords*2)?crcblock:0,0);
+  isum_init(&os,bsize,zcs,0,1);
+  zlen=inflate_summed(in,ptable[npart].hd.psize,zbuf,&rs,&os);
+  if (zlen == -1) {
     printf("\n! Decompression error for partition %s (%02x)\n",ptable[npart].pname,ptable[npart].hd.code>>16);
     errflag=1;
+    zlen=os.done;
   }
-  // create new partition image buffer and copy decompressed data into it
-  free(ptable[npart].pimage);
-  ptable[npart].pimage=malloc(zlen);
-  memcpy(ptable[npart].pimage,zbuf,zlen);
+  // decompressed image and its checksum block
+  ptable[npart].pimage=arena_alloc(zlen);
   ptable[npart].hd.psize=zlen;
-  free(zbuf);
-  // recalculate checksums
-  calc_crc16(npart);
+  cs=arena_alloc(os.nblk*2);
+  memcpy(cs,zcs,os.nblk*2);
+  set_csum(npart,cs,&os);
   ptable[npart].hd.crc=crc16((uint8_t*)&ptable[npart].hd,sizeof(struct pheader));
   ptable[npart].ztype='Z';
+  ptable[npart].doffset=0;
+  trace_end("decode");
+}
+else {
+  // image as it is in the file, the checksum block of lzma images is replaced below
+  cs=(ztype == ' ')?(uint16_t*)arena_alloc(nwords*2):0;
+  ptable[npart].pimage=(uint8_t*)arena_alloc(psize(npart));
+  isum_init(&rs,bsize,cs,(crcblocksize == nwords*2)?crcblock:0,ztype == ' ');
+  read_summed(in,ptable[npart].pimage,psize(npart),&rs);
+  if (ztype == ' ') set_csum(npart,cs,&rs);
 }
+trace_end("io");
+
+if (rs.bad != 0) {
+    printf("\n! Partition %s (%02x) - incorrect block checksum",ptable[npart].pname,ptable[npart].hd.code>>16);
+    errflag=1;
+}  
 
 // Detect lzma compression
 
-if ((ptable[npart].pimage[0] == 0x5d) && (*(uint64_t*)(ptable[npart].pimage+5) == 0xffffffffffffffff)) {
+if (ztype == 'L') {
+  trace_begin("decode","lzma %s",ptable[npart].pname);
   ptable[npart].zflag=ptable[npart].hd.psize;  // save compressed size 
-  zlen=100 * 1024 * 1024;
-  zbuf=malloc(zlen);  // 100M buffer
+  zlen=lzma_max;
+  zbuf=arena_scratch(zlen);  // 100M at the top of the arena
   // decompress partition image
-  zlen=lzma_decode(ptable[npart].pimage, ptable[npart].hd.psize, zbuf);
-  if (zlen>100 * 1024 * 1024) {
+  zlen=lzma_decode(ptable[npart].pimage, ptable[npart].hd.psize, zbuf, lzma_max);
+  if (zlen>lzma_max) {
     printf("\n Buffer size exceeded\n");
     exit(1);
   }  
-  if (res == -1) {
+  if (zlen == -1) {
     printf("\n! Decompression error for partition %s (%02x)\n",ptable[npart].pname,ptable[npart].hd.code>>16);
     errflag=1;
+    // the image stays as it is in the file
+    ptable[npart].zflag=0;
+    zbuf=ptable[npart].pimage;
+    zlen=ptable[npart].hd.psize;
   }
-  // create new partition image buffer and copy decompressed data into it
-  free(ptable[npart].pimage);
-  ptable[npart].pimage=malloc(zlen);
-  memcpy(ptable[npart].pimage,zbuf,zlen);
+  // decompressed image takes the place of the compressed one
+  arena_rewind(ptable[npart].pimage);
+  ptable[npart].pimage=memmove(arena_alloc(zlen),zbuf,zlen);
   ptable[npart].hd.psize=zlen;
-  free(zbuf);
-  // recalculate checksums
-  calc_crc16(npart);
+  // checksums and hash in one pass
+  cs=arena_alloc(csum_words(npart)*2);
+  isum_init(&os,bsize,cs,0,1);
+  isum_update(&os,ptable[npart].pimage,zlen,1);
+  set_csum(npart,cs,&os);
   ptable[npart].hd.crc=crc16((uint8_t*)&ptable[npart].hd,sizeof(struct pheader));
-  ptable[npart].ztype='L';
+  if (ptable[npart].zflag != 0) {
+    ptable[npart].ztype='L';
+    ptable[npart].doffset=0;
+  }
+  trace_end("decode");
 }
   
-  
 // advance partition counter
 npart++;
 
-// move forward if necessary to word boundary
-res=ftell(in);
-if ((res&3) != 0) fseek(in,(res+4)&(~3),SEEK_SET);
+align:
+// move forward if necessary to word boundary from the image start
+res=ftell(in)-fwbase;
+if ((res&3) != 0) fseek(in,fwbase+((res+4)&(~3)),SEEK_SET);
 }
 
 
+//*******************************************************
+//*  Arena space needed for the partitions of a file
+//*
+//* Walks the header chain from the current position and
+//* returns to it. Space for checksum blocks is counted
+//* twice (loaded and calculated), plus the decompression
+//* buffer for the largest compressed partition.
+//*******************************************************
+static uint64_t fw_memsize(FILE* in) {
+
+struct pheader hd;
+unsigned char pname[20];
+uint8_t sig[13];
+long pos,start;
+uint64_t size=0,zroom=0;
+
+start=ftell(in);
+pos=start;
+while (fread(&hd,1,sizeof(hd),in) == sizeof(hd)) {
+  if ((uint32_t)hd.magic != 0xa55aaa55) break;
+  find_pname(hd.code,pname);
+  if (part_selected(hd.code,pname)) {
+    size+=2*(hd.hdsize-sizeof(struct pheader))+hd.psize+64;
+    fseek(in,pos+hd.hdsize,SEEK_SET);
+    if (fread(sig,1,sizeof(sig),in) == sizeof(sig)) {
+      if ((*(uint16_t*)sig == 0xda78) && (zroom<zlib_max)) zroom=zlib_max;
+      if ((sig[0] == 0x5d) && (*(uint64_t*)(sig+5) == 0xffffffffffffffff)) zroom=100*1024*1024;
+    }
+  }
+  pos=fwbase+((pos-fwbase+hd.hdsize+hd.psize+3)&~3);
+  fseek(in,pos,SEEK_SET);
+}
+fseek(in,start,SEEK_SET);
+return size+zroom;
+}
+
 //*******************************************************
 //*  Search for partitions in firmware file
 //* 
+//*  hdr - offset of the first partition header, found
+//*        by select_image(), -1 - no image in the file
+//*
 //* returns number of found partitions
 //*******************************************************
-int findparts(FILE* in) {
+int findparts(FILE* in, int64_t hdr) {
 
 // BIN-file prefix buffer
 uint8_t prefix[0x5c];
 int32_t signsize;
 int32_t hd_dload_id;
+int first=npart;  // first partition of this file in the table
 
 // Partition header start marker	      
 const unsigned int dpattern=0xa55aaa55;
 unsigned int i;
 
-
-// search for beginning of partition chain in file
-while (fread(&i,1,4,in) == 4) {
-  if (i == dpattern) break;
-}
-if (feof(in)) {
+if (hdr == -1) {
   printf("\n No partitions found in file - file does not contain firmware image\n");
   exit(0);
 }  
-
-// current position in file should be no closer than 0x60 from beginning - size of entire file header
-if (ftell(in)<0x60) {
-    printf("\n File header has incorrect size\n");
-    exit(0);
-}    
-fseek(in,-0x60,SEEK_CUR); // move back to beginning of BIN file
+fwbase=hdr-0x5c;
+fseek(in,fwbase,SEEK_SET); // move back to beginning of BIN file
 
 // extract prefix
 fread(prefix,0x5c,1,in);
@@ -316,6 +695,9 @@ if (dload_id > 0xf) {
 }  
 printf("\n Firmware file code: %x (%s)\n",hd_dload_id,fw_description(hd_dload_id));
 
+// one arena chunk for all partitions of the file
+arena_reserve(fw_memsize(in));
+
 // search for remaining partitions
 
 do {
@@ -326,9 +708,13 @@ do {
   extract(in);                      // extract partition
 } while(1);
 printf("\r                                 \r");
+if (npart == first) {
+  printf("\n No partitions selected in this file");
+  return 0;
+}  
 
 // search for digital signature
-signsize=serach_sign();
+signsize=serach_sign(first);
 if (signsize == -1) printf("\n Digital signature: not found");
 else {
   printf("\n Digital signature: %i bytes",signsize);
@@ -339,46 +725,290 @@ if (((signsize == -1) && (dload_id>7)) ||
     printf("\n ! WARNING: Presence of digital signature does not match firmware type code: %02x",dload_id);
 
 
+return npart-first;
+}
+
+
+//*******************************************************
+//* Load firmware files into partition table
+//*
+//*  files - file names (directory names for multi-file mode)
+//*  nfiles - number of names
+//*  nflag - multi-file mode
+//*
+//* returns number of partitions, -1 - error
+//*******************************************************
+int load_files(char** files, int nfiles, int nflag) {
+
+FILE* in;
+int i,first,nsigned=0;
+int64_t hdr;
+
+for (i=0;i<nfiles;i++) {
+  first=npart;
+  if (nflag) {
+    // Search for firmware files in the specified directory
+    findfiles(files[i]);
+    continue;
+  }  
+  // for single-file operations
+  trace_begin("io","open %s",files[i]);
+  in=fopen(files[i],"rb");
+  trace_end("io");
+  if (in == 0) {
+    printf("\n Error opening %s",files[i]);
+    return -1;
+  }
+  if (nfiles>1) printf("\n File %s:",files[i]);
+  // Search for partitions inside the file
+  srcname=files[i];
+  trace_begin("io","header scan");
+  hdr=select_image(files[i]);
+  trace_end("io");
+  trace_begin("io","findparts %s",files[i]);
+  findparts(in,hdr);
+  trace_end("io");
+  fclose(in);
+  if (npart == first) continue; // all partitions of the file excluded
+  show_fw_info(first);
+  if (serach_sign(first) != -1) nsigned++;
+}  
+if (npart == 0) {
+  printf("\n No partitions selected for processing\n");
+  return -1;
+}  
+
+if (!nflag) {
+  // digital signature parameters are taken from the first image
+  serach_sign(0);
+  if (nsigned>1) printf("\n ! WARNING: %i images carry a digital signature, only the signature of the first one is sent",nsigned);
+}  
 return npart;
 }
 
+//*******************************************************
+//* Release all partitions of the table
+//*
+//* The table itself is kept for the next firmware.
+//*******************************************************
+void free_ptable() {
+
+// images and checksum blocks are in the arena
+arena_release();
+npart=0;
+errflag=0;
+if (!dflag) dload_id=-1;  // firmware type is taken from the next file header
+}
+
+//-------------------------------------------------------
+//  Multi-file mode
+//-------------------------------------------------------
+
+// files read at the same time
+#define read_threads 4
+
+static struct pfile* rfiles;
+static int nrfiles;
+static volatile int32_t rnext;
+
+#ifndef WIN32
+#define rnext_inc() __sync_fetch_and_add(&rnext,1)
+#else
+#define rnext_inc() (InterlockedIncrement((LONG volatile*)&rnext)-1)
+#endif
 
 //*******************************************************
-//* Search for partitions in multi-file mode
+//* Compare files by number for qsort
 //*******************************************************
-void findfiles (char* fdir) {
+static int pfile_cmp(const void* a, const void* b) {
+
+return ((struct pfile*)a)->num-((struct pfile*)b)->num;
+}
+
+//*******************************************************
+//* Reader thread - loads images and hashes them
+//*
+//* res: 1 - open error, 2 - read error, 3 - file has a header
+//*******************************************************
+#ifndef WIN32
+static void* image_reader(void* arg) {
+#else
+static DWORD WINAPI image_reader(LPVOID arg) {
+#endif
 
-char filename[200];  
+int i,n;
 FILE* in;
-  
-printf("\n Searching for partition image files...\n\n ##   Size        ID        Name          File\n-----------------------------------------------------------------\n");
 
-for (npart=0;npart<30;npart++) {
-    if (find_file(npart, fdir, filename, &ptable[npart].hd.code, &ptable[npart].hd.psize) == 0) break; // end of search - partition with this ID not found
-    // get partition symbolic name
-    find_pname(ptable[npart].hd.code,ptable[npart].pname);
-    printf("\n %02i  %8i  %08x  %-14.14s  %s",npart,ptable[npart].hd.psize,ptable[npart].hd.code,ptable[npart].pname,filename);fflush(stdout);
-    
-    // allocate memory for partition image
-    ptable[npart].pimage=malloc(ptable[npart].hd.psize);
-    if (ptable[npart].pimage == 0) {
-      printf("\n! Memory allocation error, partition #%i, size = %i bytes\n",npart,ptable[npart].hd.psize);
-      exit(0);
-    }
-    
-    // read image into buffer
-    in=fopen(filename,"rb");
-    if (in == 0) {
-      printf("\n Error opening file %s",filename);
-      return;
-    } 
-    fread(ptable[npart].pimage,ptable[npart].hd.psize,1,in);
-    fclose(in);
-      
+while ((i=rnext_inc()) < nrfiles) {
+  n=rfiles[i].part;
+  in=fopen(rfiles[i].fname,"rb");
+  if (in == 0) {
+    rfiles[i].res=1;
+    continue;
+  }
+  if (fread(ptable[n].pimage,1,ptable[n].hd.psize,in) != ptable[n].hd.psize) rfiles[i].res=2;
+  fclose(in);
+  if (rfiles[i].res != 0) continue;
+  // raw image is expected, without header
+  if ((ptable[n].hd.psize >= 4) && (*(uint32_t*)ptable[n].pimage == 0xa55aaa55)) {
+    rfiles[i].res=3;
+    continue;
+  }
+  calc_phash(n);
 }
-if (npart == 0) {
+return 0;
+}
+
+//*******************************************************
+//* Load all images at once
+//*******************************************************
+static void read_images() {
+
+int i,nt;
+#ifndef WIN32
+pthread_t th[read_threads];
+#else
+HANDLE th[read_threads];
+#endif
+
+rnext=0;
+nt=(nrfiles<read_threads)?nrfiles:read_threads;
+for (i=0;i<nt;i++) {
+#ifndef WIN32
+  if (pthread_create(&th[i],0,image_reader,0) != 0) break;
+#else
+  th[i]=CreateThread(0,0,image_reader,0,0,0);
+  if (th[i] == 0) break;
+#endif
+}
+nt=i;
+// the images left are read here
+image_reader(0);
+for (i=0;i<nt;i++) {
+#ifndef WIN32
+  pthread_join(th[i],0);
+#else
+  WaitForSingleObject(th[i],INFINITE);
+  CloseHandle(th[i]);
+#endif
+}
+}
+
+//*******************************************************
+//* Index of partition image files in a directory
+//*
+//* The directory is read once: files named
+//* NN-XXXXXXXX-Name are sorted by number, numbering
+//* starts at 00 and ends at the first gap.
+//*
+//* list - allocated array of files
+//*
+//* returns number of files
+//*******************************************************
+int index_files(char* fdir, struct pfile** list) {
+
+struct dfile* dl;
+struct pfile* pf;
+int i,n,nf=0,len;
+
+trace_begin("io","index %s",fdir);
+n=list_dir(fdir,&dl);
+pf=malloc((n?n:1)*sizeof(struct pfile));
+for (i=0;i<n;i++) {
+  // 00-00000200-M3Boot.bin, files not starting with a number are ignored
+  len=strspn(dl[i].name,"0123456789");
+  if (len == 0) continue;
+  if ((dl[i].name[len] != '-') || (dl[i].name[len+9] != '-')) {
+    printf("\n Incorrect file name format - %s\n",dl[i].name);
+    exit(1);
+  }
+  // check partition ID digit field
+  if (strspn(dl[i].name+len+1,"0123456789AaBbCcDdEeFf") != 8) {
+    printf("\n Error in partition identifier - non-digit character - %s\n",dl[i].name);
+    exit(1);
+  }
+  pf[nf].num=atoi(dl[i].name);
+  sscanf(dl[i].name+len+1,"%8x",&pf[nf].code);
+  pf[nf].size=dl[i].size;
+  pf[nf].res=0;
+#ifndef WIN32
+  snprintf(pf[nf].fname,sizeof(pf[nf].fname),"%s/%s",fdir,dl[i].name);
+#else
+  snprintf(pf[nf].fname,sizeof(pf[nf].fname),"%s\\%s",fdir,dl[i].name);
+#endif
+  nf++;
+}
+free(dl);
+trace_end("io");
+qsort(pf,nf,sizeof(struct pfile),pfile_cmp);
+
+// files are numbered from 00 without gaps
+for (i=0;i<nf;i++) {
+  if ((i>0) && (pf[i].num == pf[i-1].num)) {
+    printf("\n Two files with number %02i - %s and %s\n",pf[i].num,pf[i-1].fname,pf[i].fname);
+    exit(1);
+  }
+  if (pf[i].num != i) break;
+}
+if (i == 0) {
  printf("\n! No partition image files found in directory %s",fdir);
  exit(0);
-} 
 }
+if (i<nf) printf("\n ! No file with number %02i, files from %s on are ignored\n",i,pf[i].fname);
+*list=pf;
+return i;
+}
+
+//*******************************************************
+//* Search for partitions in multi-file mode
+//*
+//* The images are read in parallel.
+//*******************************************************
+void findfiles (char* fdir) {
+
+struct pfile* pf;
+int i,nf;
+uint64_t total=0;
 
+printf("\n Searching for partition image files...\n\n ##   Size        ID        Name          File\n-----------------------------------------------------------------\n");
+nf=index_files(fdir,&pf);
+
+// table entries of the selected files
+rfiles=pf;
+nrfiles=0;
+for (i=0;i<nf;i++) total+=pf[i].size+16;
+arena_reserve(total);
+for (i=0;i<nf;i++) {
+  ptable_add();
+  ptable[npart].hd.code=pf[i].code;
+  ptable[npart].hd.psize=pf[i].size;
+  // get partition symbolic name
+  find_pname(ptable[npart].hd.code,ptable[npart].pname);
+  if (!part_selected(ptable[npart].hd.code,ptable[npart].pname)) continue; // excluded by --only/--skip
+  printf("\n %02i  %8i  %08x  %-14.14s  %s",pf[i].num,ptable[npart].hd.psize,ptable[npart].hd.code,ptable[npart].pname,pf[i].fname);
+  ptable[npart].pimage=arena_alloc(ptable[npart].hd.psize);
+  pf[nrfiles]=pf[i];
+  pf[nrfiles].part=npart;
+  nrfiles++;
+  npart++;
+}
+fflush(stdout);
+
+trace_begin("io","read %i images",nrfiles);
+read_images();
+trace_end("io");
+for (i=0;i<nrfiles;i++) {
+  switch (pf[i].res) {
+    case 1:
+      printf("\n Error opening file %s\n",pf[i].fname);
+      exit(1);
+    case 2:
+      printf("\n Error reading file %s\n",pf[i].fname);
+      exit(1);
+    case 3:
+      printf("\n File %s has a header - not suitable for flashing\n",pf[i].fname);
+      exit(1);
+  }
+}
+free(pf);
+}
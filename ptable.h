@@ -24,6 +24,9 @@ struct pheader {
 #endif
 
 
+// largest unpacked image of a zlib compressed partition extract() accepts
+#define zlib_max 52428800
+
 // Структура описания таблицы разделов
 
 struct ptb_t{
@@ -34,19 +37,44 @@ struct ptb_t{
   uint32_t offset;   // смещение в файле до начала раздела
   uint32_t zflag;     // признак сжатого раздела  
   uint8_t ztype;    // тип сжатия
+  uint64_t phash;   // content hash of the image to be written (crc32:adler32)
+  char* fname;      // file the partition was loaded from, 0 - image file of -n mode
+  uint32_t doffset; // offset of the image data in the file, 0 - image differs from the file
 };
 
 //******************************************************
 //*  Внешние массивы для хранения таблицы разделов
 //******************************************************
-extern struct ptb_t ptable[];
+extern struct ptb_t* ptable;
 extern int npart; // число разделов в таблице
 
 extern uint32_t errflag;
 
-int findparts(FILE* in);
+int findparts(FILE* in, int64_t hdr);
 void  find_pname(unsigned int id,unsigned char* pname);
 void findfiles (char* fdir);
+
+// image file of a directory
+struct pfile {
+  int num;          // file number from the name
+  uint32_t code;    // partition code from the name
+  uint32_t size;
+  int part;         // partition table entry
+  int res;          // read result, 0 - ok
+  char fname[300];
+};
+int index_files(char* fdir, struct pfile** list);
+int load_files(char** files, int nfiles, int nflag);
+void free_ptable();
+struct ptb_t* ptable_add();
 uint32_t psize(int n);
+uint32_t csum_words(int n);
+void fill_crc16(int n, uint16_t* csblock);
+void calc_hd_crc16(int n);
+void calc_phash(int n);
+int part_filter(char* list, int skip);
+int part_selected(uint32_t code, unsigned char* pname);
+int part_in_list(char* list, uint32_t code, unsigned char* pname);
 
 extern int dload_id;
+extern int dflag;
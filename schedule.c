@@ -0,0 +1,641 @@
+//
+//   Flash station scheduler for Linux
+//
+//  The job file holds one job per line - the firmware file(s) to be written
+//  into one device; empty lines and lines starting with # are ignored.
+//  Jobs are assigned to ports holding a device in download mode, at most
+//  a given number at the same time. Every attempt runs in a child process
+//  that loads the firmware and performs a complete flashing session; its
+//  output goes to job<N>.log.
+//
+//  A job line may start with the unit it is meant for:
+//
+//    serial=<USB serial number> <file> ...
+//    usb:<topology path> <file> ...
+//
+//  Such a job runs only on the port where that unit is, and a failed
+//  attempt is retried when the unit appears again - replugged, possibly
+//  on another port. Jobs without a unit are anonymous: they take any
+//  device that is not claimed by a unit job, and a failed anonymous job
+//  is retried on a different port, i.e. on another device. The device of
+//  the failed attempt is left as it is for the operator.
+//
+//  For every port the scheduler keeps success and failure counts and the
+//  transfer speed. Ports are ranked by their smoothed success rate and that
+//  of their USB hub, and a port is quarantined after max_cfail failures in
+//  a row or when it fails more often than it succeeds. The counters can be kept across runs in a
+//  health file:
+//
+//    <port> <ok> <failed> <failed in a row> <bytes> <microseconds>
+//
+//  Ports are either device names or USB topology paths (usb:1-3.2), the
+//  latter stay valid when the tty is renumbered on replug. Without a port
+//  list all download ports found in sysfs are used.
+//
+//  After an attempt the port is not used again until its device has
+//  disappeared and a new one has been plugged in.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "ptable.h"
+#include "flasher.h"
+#include "discover.h"
+#include "util.h"
+#include "schedule.h"
+
+#define max_ports 64
+#define max_sjobs 1000
+#define max_jfiles 16
+
+// attempts per job
+#define max_attempts 3
+
+// failures in a row that quarantine a port
+#define max_cfail 3
+
+// port states
+enum {
+  P_EMPTY,     // no device
+  P_READY,     // new device waiting
+  P_BUSY,      // flashing in progress
+  P_USED       // attempt finished, waiting for the device to be replaced
+};
+
+struct sport {
+  char name[80];       // port name from the list or usb:<path>
+  char hub[80];        // hub name, empty - unknown
+  char dev[64];        // current tty
+  char upath[32];      // USB topology path of the device, empty - unknown
+  char serial[100];    // USB serial number of the device, empty - unknown
+  int state;
+  int quarantined;
+  int job;             // current job
+  pid_t pid;
+  uint64_t start;      // attempt start time, us
+  uint32_t ok,fail,cfail;
+  uint64_t bytes,usec; // data written by successful attempts and time spent
+};
+
+// job states
+enum {
+  J_PENDING,
+  J_RUNNING,
+  J_DONE,
+  J_FAILED
+};
+
+struct sjob {
+  char* line;
+  char* args;          // line split into file names
+  char* files[max_jfiles];
+  int nfiles;
+  int state;
+  int attempts;
+  uint64_t bytes;      // firmware data size
+  uint8_t tried[max_ports];
+  char unit[100];      // serial=<n> or usb:<path> of the unit, empty - any device
+};
+
+static struct sport ports[max_ports];
+static int nports=0;
+static int dynports;   // port list taken from sysfs
+
+static struct sjob* jobs=0;
+static int njobs=0;
+
+static char* healthfile=0;
+static int snflag,sforce,sreboot;
+
+//****************************************************
+//* Smoothed success rate
+//****************************************************
+static double srate(uint32_t ok, uint32_t fail) {
+
+return (ok+1.0)/(ok+fail+2.0);
+}
+
+//****************************************************
+//* Port speed, MB/s
+//****************************************************
+static double port_speed(struct sport* p) {
+
+if (p->usec == 0) return 0;
+return (double)p->bytes/p->usec;
+}
+
+//****************************************************
+//* Add port to the table
+//****************************************************
+static struct sport* add_port(char* name) {
+
+struct sport* p;
+char* sptr;
+
+if (nports == max_ports) return 0;
+p=&ports[nports++];
+memset(p,0,sizeof(struct sport));
+snprintf(p->name,sizeof(p->name),"%s",name);
+p->state=P_EMPTY;
+p->job=-1;
+if (strncmp(name,"usb:",4) == 0) {
+  // hub is the topology path without the last port number
+  strcpy(p->hub,name);
+  sptr=strrchr(p->hub,'.');
+  if (sptr == 0) sptr=strchr(p->hub,'-');
+  if (sptr != 0) *sptr=0;
+}
+return p;
+}
+
+//****************************************************
+//* Find port by name
+//****************************************************
+static struct sport* find_sport(char* name) {
+
+int i;
+
+for (i=0;i<nports;i++) {
+  if (strcmp(ports[i].name,name) == 0) return &ports[i];
+}
+return 0;
+}
+
+//****************************************************
+//* Quarantine rule
+//****************************************************
+static void check_quarantine(struct sport* p) {
+
+if ((p->cfail >= max_cfail) || ((p->ok+p->fail >= 5) && (p->fail > p->ok))) p->quarantined=1;
+}
+
+//****************************************************
+//* Load health file
+//****************************************************
+static void health_load() {
+
+FILE* in;
+char line[300],name[80];
+struct sport* p;
+uint32_t ok,fail,cfail;
+unsigned long long bytes,usec;
+
+in=fopen(healthfile,"r");
+if (in == 0) return;
+while (fgets(line,sizeof(line),in) != 0) {
+  if (sscanf(line,"%79s %u %u %u %llu %llu",name,&ok,&fail,&cfail,&bytes,&usec) != 6) continue;
+  p=find_sport(name);
+  if (p == 0) {
+    if (!dynports) continue;  // port is not in the list
+    p=add_port(name);
+    if (p == 0) break;
+  }
+  p->ok=ok;
+  p->fail=fail;
+  p->cfail=cfail;
+  p->bytes=bytes;
+  p->usec=usec;
+  check_quarantine(p);
+}
+fclose(in);
+}
+
+//****************************************************
+//* Write health file
+//****************************************************
+static void health_save() {
+
+FILE* out;
+char tmpname[300];
+int i;
+
+if (healthfile == 0) return;
+snprintf(tmpname,sizeof(tmpname),"%s.tmp",healthfile);
+out=fopen(tmpname,"w");
+if (out == 0) {
+  printf("\n! Health file %s cannot be written",tmpname);
+  return;
+}
+for (i=0;i<nports;i++) {
+  fprintf(out,"%s %u %u %u %llu %llu\n",ports[i].name,ports[i].ok,ports[i].fail,ports[i].cfail,
+         (unsigned long long)ports[i].bytes,(unsigned long long)ports[i].usec);
+}
+fclose(out);
+rename(tmpname,healthfile);
+}
+
+//****************************************************
+//* Success rate of the port's hub
+//****************************************************
+static double hub_rate(struct sport* p) {
+
+int i;
+uint32_t ok=0,fail=0;
+
+if (p->hub[0] == 0) return 1.0;
+for (i=0;i<nports;i++) {
+  if (strcmp(ports[i].hub,p->hub) != 0) continue;
+  ok+=ports[i].ok;
+  fail+=ports[i].fail;
+}
+return srate(ok,fail);
+}
+
+//****************************************************
+//* Port rank for job assignment
+//****************************************************
+static double port_score(struct sport* p) {
+
+return srate(p->ok,p->fail)*hub_rate(p);
+}
+
+//****************************************************
+//* Update device presence on all ports
+//****************************************************
+static void scan_ports() {
+
+static char upath[max_ports][32];
+static char udev[max_ports][64];
+char name[80];
+struct sport* p;
+int i,j,nu,present;
+
+nu=list_usb_ports(upath,udev,max_ports);
+if (dynports) {
+  // new ports found in sysfs join the table
+  for (j=0;j<nu;j++) {
+    snprintf(name,sizeof(name),"usb:%.31s",upath[j]);
+    if (find_sport(name) == 0) add_port(name);
+  }
+}
+
+for (i=0;i<nports;i++) {
+  p=&ports[i];
+  if (p->state == P_BUSY) continue;
+  present=0;
+  p->upath[0]=0;
+  if (strncmp(p->name,"usb:",4) == 0) {
+    for (j=0;j<nu;j++) {
+      if (strcmp(p->name+4,upath[j]) == 0) {
+        strcpy(p->dev,udev[j]);
+        strcpy(p->upath,upath[j]);
+        present=1;
+        break;
+      }
+    }
+  }
+  else {
+    strcpy(p->dev,p->name);
+    present=(access(p->dev,F_OK) == 0);
+    for (j=0;j<nu;j++) {
+      if (strcmp(p->dev,udev[j]) == 0) strcpy(p->upath,upath[j]);
+    }
+  }
+  if (!present) p->state=P_EMPTY;
+  else if (p->state == P_EMPTY) {
+    // new device
+    p->state=P_READY;
+    usb_serial(p->dev,p->serial,sizeof(p->serial));
+  }
+}
+}
+
+//****************************************************
+//* Check whether the port holds the unit of the job
+//****************************************************
+static int unit_on_port(char* unit, struct sport* p) {
+
+if (strncmp(unit,"serial=",7) == 0) return (p->serial[0] != 0) && (strcmp(unit+7,p->serial) == 0);
+return (p->upath[0] != 0) && (strcmp(unit+4,p->upath) == 0);
+}
+
+//****************************************************
+//* Check whether the port holds a unit that an unfinished
+//* job is meant for
+//****************************************************
+static int unit_claimed(struct sport* p) {
+
+int i;
+
+for (i=0;i<njobs;i++) {
+  if ((jobs[i].unit[0] == 0) || (jobs[i].state != J_PENDING)) continue;
+  if (unit_on_port(jobs[i].unit,p)) return 1;
+}
+return 0;
+}
+
+//****************************************************
+//* Choose port for the job
+//*
+//* A unit job takes the port where its unit is. Anonymous jobs
+//* use ports already tried by the job only when no other
+//* healthy port exists.
+//****************************************************
+static struct sport* pick_port(int jn) {
+
+struct sport* best=0;
+struct sport* p;
+int i,untried=0;
+double score,bscore=-1;
+
+if (jobs[jn].unit[0] != 0) {
+  for (i=0;i<nports;i++) {
+    p=&ports[i];
+    if ((p->state == P_READY) && !p->quarantined && unit_on_port(jobs[jn].unit,p)) return p;
+  }
+  return 0;
+}
+for (i=0;i<nports;i++) {
+  if (!ports[i].quarantined && !jobs[jn].tried[i]) untried=1;
+}
+for (i=0;i<nports;i++) {
+  p=&ports[i];
+  if ((p->state != P_READY) || p->quarantined || unit_claimed(p)) continue;
+  if (untried && jobs[jn].tried[i]) continue;
+  score=port_score(p);
+  if ((best == 0) || (score > bscore) || ((score == bscore) && (port_speed(p) > port_speed(best)))) {
+    best=p;
+    bscore=score;
+  }
+}
+return best;
+}
+
+//****************************************************
+//* Start job attempt on the port
+//****************************************************
+static void start_attempt(int jn, struct sport* p) {
+
+struct sjob* j=&jobs[jn];
+char logname[40];
+pid_t pid;
+int fd;
+
+j->attempts++;
+fflush(stdout);
+pid=fork();
+if (pid == -1) {
+  printf("\n! Process for job %i cannot be started",jn+1);
+  j->attempts--;
+  return;
+}
+if (pid == 0) {
+  // flashing process
+  snprintf(logname,sizeof(logname),"job%i.log",jn+1);
+  fd=open(logname,O_WRONLY|O_CREAT|O_APPEND,0644);
+  if (fd != -1) {
+    dup2(fd,1);
+    close(fd);
+  }
+  printf("\n===== Attempt %i, port %s (%s)\n",j->attempts,p->name,p->dev);
+  if ((load_files(j->files,j->nfiles,snflag) == -1) || (errflag && !sforce)) exit(-1);
+  exit(flash_session(p->dev,sreboot,0));
+}
+j->state=J_RUNNING;
+j->tried[p-ports]=1;
+p->state=P_BUSY;
+p->job=jn;
+p->pid=pid;
+p->start=now_us();
+printf("\n Job %i: attempt %i on %s (%s)",jn+1,j->attempts,p->name,p->dev);
+}
+
+//****************************************************
+//* Collect finished attempts
+//****************************************************
+static void reap_attempts() {
+
+pid_t pid;
+int i,status;
+struct sport* p;
+struct sjob* j;
+uint64_t usec;
+
+while ((pid=waitpid(-1,&status,WNOHANG)) > 0) {
+  for (i=0;i<nports;i++) {
+    if ((ports[i].state == P_BUSY) && (ports[i].pid == pid)) break;
+  }
+  if (i == nports) continue;
+  p=&ports[i];
+  j=&jobs[p->job];
+  usec=now_us()-p->start;
+  p->state=P_USED;
+  if (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+    p->ok++;
+    p->cfail=0;
+    p->bytes+=j->bytes;
+    p->usec+=usec;
+    j->state=J_DONE;
+    printf("\n Job %i: done on %s, %.1f s, %.2f MB/s",p->job+1,p->name,usec/1e6,(double)j->bytes/usec);
+  }
+  else {
+    p->fail++;
+    p->cfail++;
+    check_quarantine(p);
+    j->state=(j->attempts >= max_attempts)?J_FAILED:J_PENDING;
+    printf("\n Job %i: FAILED on %s%s",p->job+1,p->name,(j->state == J_FAILED)?", no attempts left":", will be retried");
+    if (p->quarantined) printf("\n Port %s quarantined",p->name);
+  }
+  p->job=-1;
+  health_save();
+}
+}
+
+//****************************************************
+//* Read job file
+//****************************************************
+static void read_jobs(char* jobfile) {
+
+FILE* in;
+char line[1000];
+char* sptr;
+struct sjob* j;
+
+in=fopen(jobfile,"r");
+if (in == 0) {
+  printf("\n Error opening job file %s\n",jobfile);
+  exit(-1);
+}
+while (fgets(line,sizeof(line),in) != 0) {
+  line[strcspn(line,"\r\n")]=0;
+  sptr=line+strspn(line," \t");
+  if ((*sptr == 0) || (*sptr == '#')) continue;
+  if (njobs == max_sjobs) break;
+  jobs=realloc(jobs,(njobs+1)*sizeof(struct sjob));
+  j=&jobs[njobs++];
+  memset(j,0,sizeof(struct sjob));
+  j->line=strdup(sptr);
+  j->args=strdup(sptr);
+  sptr=strtok(j->args," \t");
+  // unit the job is meant for
+  if ((sptr != 0) && ((strncmp(sptr,"serial=",7) == 0) || (strncmp(sptr,"usb:",4) == 0))) {
+    snprintf(j->unit,sizeof(j->unit),"%s",sptr);
+    sptr=strtok(0," \t");
+  }
+  for (;(sptr != 0) && (j->nfiles<max_jfiles);sptr=strtok(0," \t")) j->files[j->nfiles++]=sptr;
+  if (j->nfiles == 0) {
+    printf("\n Job file %s: no firmware in line %s\n",jobfile,j->line);
+    exit(-1);
+  }
+}
+fclose(in);
+}
+
+//****************************************************
+//* Check job firmware and compute its size
+//****************************************************
+static void check_jobs() {
+
+int i,k,n;
+
+for (i=0;i<njobs;i++) {
+  // identical lines share the result
+  for (k=0;k<i;k++) {
+    if (jobs[k].nfiles != jobs[i].nfiles) continue;
+    for (n=0;n<jobs[i].nfiles;n++) {
+      if (strcmp(jobs[k].files[n],jobs[i].files[n]) != 0) break;
+    }
+    if (n == jobs[i].nfiles) break;
+  }
+  if (k<i) {
+    jobs[i].bytes=jobs[k].bytes;
+    continue;
+  }
+  printf("\n\n Job %i:",i+1);
+  free_ptable();
+  if (load_files(jobs[i].files,jobs[i].nfiles,snflag) == -1) exit(-1);
+  if (errflag && !sforce) {
+    printf("\n\n! Job %i firmware contains errors\n",i+1);
+    exit(-1);
+  }
+  for (n=0;n<npart;n++) jobs[i].bytes+=ptable[n].hd.psize;
+}
+free_ptable();
+}
+
+//****************************************************
+//* Print port statistics
+//****************************************************
+static void port_report() {
+
+int i,k;
+uint32_t ok,fail;
+
+printf("\n\n Port                   OK  Fail  Rate   MB/s  State");
+printf("\n-----------------------------------------------------------");
+for (i=0;i<nports;i++) {
+  printf("\n %-20.20s %4u  %4u  %3.0f%%  %5.2f  %s",ports[i].name,ports[i].ok,ports[i].fail,
+         (ports[i].ok+ports[i].fail)?100.0*ports[i].ok/(ports[i].ok+ports[i].fail):0.0,
+         port_speed(&ports[i]),ports[i].quarantined?"quarantined":"");
+}
+for (i=0;i<nports;i++) {
+  if (ports[i].hub[0] == 0) continue;
+  for (k=0;k<i;k++) {
+    if (strcmp(ports[k].hub,ports[i].hub) == 0) break;
+  }
+  if (k<i) continue;  // hub already shown
+  ok=fail=0;
+  for (k=i;k<nports;k++) {
+    if (strcmp(ports[k].hub,ports[i].hub) != 0) continue;
+    ok+=ports[k].ok;
+    fail+=ports[k].fail;
+  }
+  printf("\n Hub %-16.16s %4u  %4u  %3.0f%%",ports[i].hub+4,ok,fail,(ok+fail)?100.0*ok/(ok+fail):0.0);
+}
+printf("\n");
+}
+
+//****************************************************
+//* Scheduler main loop
+//*
+//*  jobfile - job list
+//*  portlist - comma-separated port list, 0 - ports from sysfs
+//*  parallel - maximum number of simultaneous attempts, 0 - no limit
+//*  hfile - health file, 0 - none
+//*  nflag - multi-file mode
+//*  force - accept firmware with CRC errors
+//*  reboot - reboot devices after flashing
+//****************************************************
+int run_schedule(char* jobfile, char* portlist, int parallel, char* hfile, int nflag, int force, int reboot) {
+
+char* sptr;
+struct sport* p;
+int i,nbusy,nleft,usable,waiting=0;
+int ndone=0,nfailed=0;
+
+healthfile=hfile;
+snflag=nflag;
+sforce=force;
+sreboot=reboot;
+
+read_jobs(jobfile);
+if (njobs == 0) {
+  printf("\n Job file %s contains no jobs\n",jobfile);
+  return -1;
+}
+check_jobs();
+
+dynports=(portlist == 0);
+if (portlist != 0) {
+  for (sptr=strtok(portlist,",");sptr != 0;sptr=strtok(0,",")) {
+    if (find_sport(sptr) == 0) add_port(sptr);
+  }
+}
+if (healthfile != 0) health_load();
+if (parallel <= 0) parallel=max_ports;
+
+printf("\n\n Jobs: %i, parallel attempts: %i\n",njobs,parallel);
+fflush(stdout);
+
+for (;;) {
+  scan_ports();
+  reap_attempts();
+
+  nbusy=nleft=usable=0;
+  for (i=0;i<nports;i++) {
+    if (ports[i].state == P_BUSY) nbusy++;
+    if (!ports[i].quarantined) usable++;
+  }
+  for (i=0;i<njobs;i++) {
+    if ((jobs[i].state == J_PENDING) || (jobs[i].state == J_RUNNING)) nleft++;
+  }
+  if (nleft == 0) break;
+  if ((usable == 0) && !dynports && (nbusy == 0)) {
+    printf("\n! All ports are quarantined");
+    break;
+  }
+
+  // assign pending jobs in file order
+  for (i=0;(i<njobs) && (nbusy<parallel);i++) {
+    if (jobs[i].state != J_PENDING) continue;
+    p=pick_port(i);
+    if (p == 0) continue;  // no device for this job now
+    start_attempt(i,p);
+    if (jobs[i].state == J_RUNNING) nbusy++;
+  }
+  if ((nbusy == 0) && !waiting) {
+    printf("\n Waiting for devices...");
+    waiting=1;
+  }
+  if (nbusy != 0) waiting=0;
+  fflush(stdout);
+  usleep(200000);
+}
+
+for (i=0;i<njobs;i++) {
+  if (jobs[i].state == J_DONE) ndone++;
+  else {
+    nfailed++;
+    printf("\n Job %i not completed: %s",i+1,jobs[i].line);
+  }
+}
+port_report();
+printf("\n Jobs done: %i, failed: %i\n",ndone,nfailed);
+return (nfailed == 0)?0:-1;
+}
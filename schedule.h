@@ -0,0 +1 @@
+int run_schedule(char* jobfile, char* portlist, int parallel, char* hfile, int nflag, int force, int reboot);
@@ -70,7 +70,7 @@ extern int dflag;
 uint32_t signtype; // firmware type
 uint32_t signlen;  // signature length
 
-int32_t serach_sign();
+int32_t serach_sign(int first);
 
 // Public key hash for ^signver
 char signver_hash[100]="778A8D175E602B7B779D9E05C330B5279B0661BF2EED99A20445B366D63DD697";
@@ -209,7 +209,7 @@ uint8_t replybuf[200];
 if (gflag == 0) {  
   // digital signature auto-detection
   signtype=dload_id&0x7;
-  signlen=serach_sign();
+  signlen=serach_sign(0);
   if (signlen == -1) return; // signature not found in file
 }
 
@@ -224,14 +224,16 @@ if ( (res<sizeof(SVrsp)) || (memcmp(replybuf,SVrsp,sizeof(SVrsp)) != 0) ) {
 
 //***************************************************
 //* Search for digital signature in firmware
+//*
+//*  first - first partition of the firmware image in the table
 //***************************************************
-int32_t serach_sign() {
+int32_t serach_sign(int first) {
 
 int i,j;
 uint32_t pt;
 uint32_t signsize;
 
-for (i=0;i<2;i++) {
+for (i=first;i<first+2;i++) {
   if (i == npart) break;
   pt=*((uint32_t*)&ptable[i].pimage[ptable[i].hd.psize-4]);
   if (pt == 0xffaaaffa) { 
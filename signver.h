@@ -1,4 +1,5 @@
 extern char signver_hash[100];
+extern int gflag;
 
 
 void glist();
@@ -6,7 +7,7 @@ void gparm(char* sparm);
 void dparm(char* sparm);
 void send_signver();
 char* fw_description(uint8_t code);
-int32_t serach_sign();
+int32_t serach_sign(int first);
 
 
 extern char* fwtypes[];
\ No newline at end of file
@@ -0,0 +1,223 @@
+//
+//   HDLC layer statistics
+//
+//  Every command sent with send_cmd and atcmd is accounted in its class:
+//  latency histogram with power-of-two microsecond buckets, bytes before
+//  and after escaping, timeouts and rejected commands. Together with the
+//  per-partition write speed this shows whether a session is limited by
+//  the link (block latency grows with escaping), by the bootloader (long
+//  start/end latency - NAND erase and programming) or by the host.
+//
+//  The statistics are written as JSON to the --stats file at the end of
+//  the run, and on Linux also when SIGUSR1 is received.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#else
+#include <windows.h>
+#include "printf.h"
+#endif
+
+#include "ptable.h"
+#include "flasher.h"
+#include "util.h"
+#include "stats.h"
+
+// statistics file name, 0 - statistics are not written
+char* sname=0;
+
+// command classes
+enum {
+  SC_START,
+  SC_BLOCK,
+  SC_END,
+  SC_AT,
+  SC_OTHER,
+  SC_NUM
+};
+
+static char* cnames[SC_NUM]={"start","block","end","at","other"};
+
+// histogram bucket n holds latencies from 2^(n-1) to 2^n-1 us
+#define st_buckets 28
+
+static struct {
+  uint32_t count;
+  uint32_t timeouts;
+  uint32_t rejects;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t raw;      // command bytes before escaping, with CRC
+  uint64_t wire;     // bytes sent to the port
+  uint64_t reply;    // reply bytes after unescaping
+  uint32_t hist[st_buckets];
+} cstat[SC_NUM];
+
+// written partitions
+struct pstat {
+  char name[20];
+  uint32_t size;
+  uint64_t us;
+};
+static struct pstat* pst=0;
+static int npst=0;
+
+static uint64_t st_start;
+
+#ifndef WIN32
+static volatile sig_atomic_t dump_req=0;
+#endif
+
+//****************************************************
+//* Add command to its class
+//****************************************************
+static void account(int cls, uint64_t us) {
+
+int n=0;
+
+cstat[cls].count++;
+cstat[cls].total_us+=us;
+if (us>cstat[cls].max_us) cstat[cls].max_us=us;
+while ((us != 0) && (n<st_buckets-1)) {
+  us>>=1;
+  n++;
+}
+cstat[cls].hist[n]++;
+}
+
+//****************************************************
+//* Account HDLC command
+//*
+//*  cmd - command code
+//*  us - time from sending to the end of the reply
+//*  raw, wire - command length before and after escaping
+//*  reply, rlen - reply, 0 - no reply
+//****************************************************
+void stats_cmd(uint8_t cmd, uint64_t us, uint32_t raw, uint32_t wire, uint8_t* reply, uint32_t rlen) {
+
+int cls;
+
+switch (cmd) {
+  case 0x41: cls=SC_START; break;
+  case 0x42: cls=SC_BLOCK; break;
+  case 0x43: cls=SC_END; break;
+  default:   cls=SC_OTHER;
+}
+account(cls,us);
+cstat[cls].raw+=raw;
+cstat[cls].wire+=wire;
+cstat[cls].reply+=rlen;
+if (rlen == 0) cstat[cls].timeouts++;
+else if ((cls != SC_OTHER) && ((rlen<2) || (reply[1] != 2))) cstat[cls].rejects++;
+#ifndef WIN32
+if (dump_req) {
+  dump_req=0;
+  stats_write();
+}
+#endif
+}
+
+//****************************************************
+//* Account AT command
+//****************************************************
+void stats_at(uint64_t us, uint32_t len, char* reply, int rlen) {
+
+account(SC_AT,us);
+cstat[SC_AT].raw+=len;
+cstat[SC_AT].wire+=len;
+cstat[SC_AT].reply+=rlen;
+if ((rlen == 0) || !at_done(reply,rlen)) cstat[SC_AT].timeouts++;
+}
+
+//****************************************************
+//* Account written partition
+//****************************************************
+void stats_part(int part, uint64_t us) {
+
+pst=realloc(pst,(npst+1)*sizeof(struct pstat));
+strncpy(pst[npst].name,ptable[part].pname,sizeof(pst[npst].name)-1);
+pst[npst].name[sizeof(pst[npst].name)-1]=0;
+pst[npst].size=ptable[part].hd.psize;
+pst[npst].us=us;
+npst++;
+}
+
+//****************************************************
+//* Write statistics file
+//****************************************************
+void stats_write() {
+
+FILE* out;
+char tmpname[300];
+int i,n,first;
+uint64_t raw=0,wire=0,us=0;
+uint32_t timeouts=0,rejects=0;
+
+if (sname == 0) return;
+snprintf(tmpname,sizeof(tmpname),"%s.tmp",sname);
+out=fopen(tmpname,"w");
+if (out == 0) return;
+
+fprintf(out,"{\n  \"elapsed_s\": %.3f,\n  \"block_size\": %u,\n  \"commands\": {",(now_us()-st_start)/1e6,fblock);
+for (i=0;i<SC_NUM;i++) {
+  fprintf(out,"%s\n    \"%s\": {\"count\": %u, \"timeouts\": %u, \"rejects\": %u, \"total_us\": %llu, \"mean_us\": %llu, \"max_us\": %llu, "
+              "\"bytes_raw\": %llu, \"bytes_wire\": %llu, \"bytes_reply\": %llu,\n      \"histogram\": [",
+          (i == 0)?"":",",cnames[i],cstat[i].count,cstat[i].timeouts,cstat[i].rejects,
+          (unsigned long long)cstat[i].total_us,
+          (unsigned long long)(cstat[i].count?cstat[i].total_us/cstat[i].count:0),
+          (unsigned long long)cstat[i].max_us,(unsigned long long)cstat[i].raw,
+          (unsigned long long)cstat[i].wire,(unsigned long long)cstat[i].reply);
+  // only non-empty buckets, "lt_us" - upper bound of the bucket
+  first=1;
+  for (n=0;n<st_buckets;n++) {
+    if (cstat[i].hist[n] == 0) continue;
+    fprintf(out,"%s{\"lt_us\": %llu, \"count\": %u}",first?"":", ",1ULL<<n,cstat[i].hist[n]);
+    first=0;
+  }
+  fprintf(out,"]}");
+  raw+=cstat[i].raw;
+  wire+=cstat[i].wire;
+  timeouts+=cstat[i].timeouts;
+  rejects+=cstat[i].rejects;
+}
+fprintf(out,"\n  },\n  \"totals\": {\"bytes_raw\": %llu, \"bytes_wire\": %llu, \"expansion\": %.4f, \"timeouts\": %u, \"rejects\": %u},",
+        (unsigned long long)raw,(unsigned long long)wire,raw?(double)wire/raw:0.0,timeouts,rejects);
+fprintf(out,"\n  \"partitions\": [");
+for (i=0;i<npst;i++) {
+  fprintf(out,"%s\n    {\"name\": ",(i == 0)?"":",");
+  json_string(out,pst[i].name);
+  us=pst[i].us?pst[i].us:1;
+  fprintf(out,", \"size\": %u, \"seconds\": %.3f, \"mbps\": %.3f}",pst[i].size,pst[i].us/1e6,(double)pst[i].size/us);
+}
+fprintf(out,"\n  ]\n}\n");
+fclose(out);
+remove(sname);
+rename(tmpname,sname);
+}
+
+#ifndef WIN32
+//****************************************************
+//* SIGUSR1 handler - the file is written by the next command
+//****************************************************
+static void stats_signal(int sig) {
+
+dump_req=1;
+}
+#endif
+
+//****************************************************
+//* Enable statistics file
+//****************************************************
+void stats_init() {
+
+st_start=now_us();
+if (sname == 0) return;
+atexit(stats_write);
+#ifndef WIN32
+signal(SIGUSR1,stats_signal);
+#endif
+}
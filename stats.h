@@ -0,0 +1,9 @@
+#include <stdint.h>
+
+extern char* sname;
+
+void stats_init();
+void stats_write();
+void stats_cmd(uint8_t cmd, uint64_t us, uint32_t raw, uint32_t wire, uint8_t* reply, uint32_t rlen);
+void stats_at(uint64_t us, uint32_t len, char* reply, int rlen);
+void stats_part(int part, uint64_t us);
@@ -0,0 +1,83 @@
+//
+//   TCP transport backend for Linux
+//
+//  The modem is attached to a remote host and exported as a raw TCP port,
+//  e.g. by ser2net in raw mode (RFC 2217 negotiation is not supported):
+//
+//    -p tcp:<host>:<port>
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "transport.h"
+
+//*************************************************
+//*  Discard unread input
+//*************************************************
+static void tcp_flush(struct transport* t) {
+
+char buf[4096];
+
+while (recv(t->fd,buf,sizeof(buf),MSG_DONTWAIT)>0);
+}
+
+static struct tops tcp_ops={fd_write,fd_read,tcp_flush,fd_close};
+
+//*************************************************
+//*  Connect to the port
+//*
+//*  spec - <host>:<port>
+//*************************************************
+struct transport* tcp_open(char* spec) {
+
+struct transport* t;
+struct addrinfo hints,*res,*ai;
+char host[256];
+char* sptr;
+int fd=-1,on=1;
+
+snprintf(host,sizeof(host),"%s",spec);
+sptr=strrchr(host,':');
+if (sptr == 0) {
+  printf("\n Port number is missing in tcp:%s",spec);
+  return 0;
+}
+*sptr++=0;
+
+memset(&hints,0,sizeof(hints));
+hints.ai_family=AF_UNSPEC;
+hints.ai_socktype=SOCK_STREAM;
+if (getaddrinfo(host,sptr,&hints,&res) != 0) {
+  printf("\n Host %s not found",host);
+  return 0;
+}
+for (ai=res;ai != 0;ai=ai->ai_next) {
+  fd=socket(ai->ai_family,ai->ai_socktype,ai->ai_protocol);
+  if (fd == -1) continue;
+  if (connect(fd,ai->ai_addr,ai->ai_addrlen) == 0) break;
+  close(fd);
+  fd=-1;
+}
+freeaddrinfo(res);
+if (fd == -1) return 0;
+
+// frames are written in one piece - send them at once
+setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+fcntl(fd,F_SETFL,O_NONBLOCK);
+
+t=calloc(1,sizeof(struct transport));
+t->ops=&tcp_ops;
+t->fd=fd;
+t->timeout=3000;
+t->window=1;
+return t;
+}
@@ -0,0 +1,122 @@
+//
+//   Session timeline in Chrome trace format
+//
+//  Spans are written as begin/end events of the JSON array trace format,
+//  which opens in chrome://tracing and in Perfetto. Every event is built
+//  in a buffer and written with a single fwrite, so events of different
+//  threads do not mix.
+//  The closing bracket is optional in this format - a trace of a session
+//  that was aborted is still readable.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#ifndef WIN32
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#else
+#include <windows.h>
+#include <process.h>
+#include "printf.h"
+#endif
+
+#include "util.h"
+#include "trace.h"
+
+// trace file name, 0 - tracing disabled
+char* tname=0;
+
+static FILE* tfile=0;
+static int tpid;
+
+//****************************************************
+//* Current thread id
+//****************************************************
+static int trace_tid() {
+
+#ifndef WIN32
+return syscall(SYS_gettid);
+#else
+return GetCurrentThreadId();
+#endif
+}
+
+//****************************************************
+//* Write event
+//****************************************************
+static void trace_event(char ph, char* cat, char* name) {
+
+// names are up to 200 bytes, 6 bytes per character when escaped
+char ev[1500];
+unsigned char* s=(unsigned char*)name;
+int len;
+
+len=snprintf(ev,sizeof(ev),"{\"ph\": \"%c\", \"cat\": \"%s\", \"name\": \"",ph,cat);
+for (;(*s != 0) && (len<(int)sizeof(ev)-100);s++) {
+  if ((*s == '"') || (*s == '\\')) len+=snprintf(ev+len,sizeof(ev)-len,"\\%c",*s);
+  else if (*s<0x20) len+=snprintf(ev+len,sizeof(ev)-len,"\\u%04x",*s);
+  else ev[len++]=*s;
+}
+len+=snprintf(ev+len,sizeof(ev)-len,"\", \"ts\": %llu, \"pid\": %i, \"tid\": %i},\n",(unsigned long long)now_us(),tpid,trace_tid());
+fwrite(ev,1,len,tfile);
+}
+
+//****************************************************
+//* Begin span
+//*
+//*  cat - category (io, decode, handshake, hdlc)
+//*  fmt - span name format
+//****************************************************
+void trace_begin(char* cat, char* fmt, ...) {
+
+char name[200];
+va_list ap;
+
+if (tfile == 0) return;
+va_start(ap,fmt);
+vsnprintf(name,sizeof(name),fmt,ap);
+va_end(ap);
+trace_event('B',cat,name);
+}
+
+//****************************************************
+//* End the innermost span of the thread
+//****************************************************
+void trace_end(char* cat) {
+
+if (tfile == 0) return;
+trace_event('E',cat,"");
+}
+
+//****************************************************
+//* Close trace file
+//****************************************************
+static void trace_close() {
+
+if (tfile == 0) return;
+fprintf(tfile,"{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %i, \"args\": {\"name\": \"balong_flash\"}}\n]\n",tpid);
+fclose(tfile);
+tfile=0;
+}
+
+//****************************************************
+//* Open trace file
+//****************************************************
+void trace_init() {
+
+if (tname == 0) return;
+tfile=fopen(tname,"w");
+if (tfile == 0) {
+  printf("\n Trace file %s cannot be created\n",tname);
+  exit(-1);
+}
+#ifndef WIN32
+tpid=getpid();
+#else
+tpid=_getpid();
+#endif
+fprintf(tfile,"[\n");
+atexit(trace_close);
+}
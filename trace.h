@@ -0,0 +1,5 @@
+extern char* tname;
+
+void trace_init();
+void trace_begin(char* cat, char* fmt, ...);
+void trace_end(char* cat);
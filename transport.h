@@ -0,0 +1,49 @@
+#include <stdint.h>
+
+struct transport;
+
+// Transport backend operations
+struct tops {
+  // write the whole buffer, returns 0 on error
+  int  (*write)(struct transport* t, void* buf, int len);
+  // read available bytes waiting at most timeout ms for the first one,
+  // returns number of bytes, 0 - nothing arrived
+  int  (*read)(struct transport* t, void* buf, int len, int timeout);
+  // discard unread input
+  void (*flush)(struct transport* t);
+  void (*close)(struct transport* t);
+};
+
+struct transport {
+  struct tops* ops;
+  int timeout;      // reply byte timeout, ms
+  int fd;           // fd of serial, pty and tcp ports
+  void* ctx;        // backend data
+  int window;       // commands that may be sent before their replies are read
+  int inflight;     // commands sent, replies not read yet
+};
+
+// largest window of any backend
+#define max_window 32
+
+// session port
+extern struct transport* sio;
+
+struct transport* transport_open(char* devname);
+struct transport* serial_open(char* devname);
+struct transport* replay_open(char* spec);
+#ifndef WIN32
+struct transport* pty_open(char* spec);
+struct transport* tcp_open(char* spec);
+struct transport* agent_open(char* spec);
+
+// operations shared by fd-based backends
+int fd_write(struct transport* t, void* buf, int len);
+int fd_read(struct transport* t, void* buf, int len, int timeout);
+void fd_close(struct transport* t);
+#endif
+
+int send_cmd_t(struct transport* t, unsigned char* incmdbuf, int blen, unsigned char* iobuf);
+int atcmd_t(struct transport* t, char* cmd, char* rbuf, int timeout);
+int send_cmd_post(unsigned char* incmdbuf, int blen);
+int recv_cmd_reply(unsigned char* iobuf);
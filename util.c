@@ -1,6 +1,9 @@
 // 
 //   Auxiliary procedures for balong_flash project
 // 
+#ifndef WIN32
+#define _GNU_SOURCE   // copy_file_range
+#endif
 #include <stdio.h>
 #include <stdint.h>
 #ifndef WIN32
@@ -12,7 +15,9 @@
 #include <strings.h>
 #include <termios.h>
 #include <unistd.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #else
 #include <windows.h>
 #include "getopt.h"
@@ -55,6 +60,63 @@ for (i=0;i<len;i+=16) {
 }
 
 
+//*************************************************
+//*  Output string as JSON string literal, 0 - null
+//*************************************************
+void json_string(FILE* out, char* str) {
+
+unsigned char* s=(unsigned char*)str;
+
+if (s == 0) {
+  fprintf(out,"null");
+  return;
+}
+fputc('"',out);
+for (;*s != 0;s++) {
+  if ((*s == '"') || (*s == '\\')) fprintf(out,"\\%c",*s);
+  else if (*s<0x20) fprintf(out,"\\u%04x",*s);
+  else fputc(*s,out);
+}
+fputc('"',out);
+}
+
+//*************************************************
+//*  Monotonic time in microseconds
+//*************************************************
+uint64_t now_us() {
+
+#ifndef WIN32
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC,&ts);
+return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+#else
+LARGE_INTEGER freq,cnt;
+
+QueryPerformanceFrequency(&freq);
+QueryPerformanceCounter(&cnt);
+return (uint64_t)(cnt.QuadPart/freq.QuadPart)*1000000+(cnt.QuadPart%freq.QuadPart)*1000000/freq.QuadPart;
+#endif
+}
+
+//*************************************************
+//*  Check whether AT command response is complete,
+//*  i.e. ends with a final result line (OK, ERROR, +CME ERROR)
+//*************************************************
+int at_done(char* buf, int len) {
+
+int i,llen;
+
+if ((len<2) || (buf[len-2] != '\r') || (buf[len-1] != '\n')) return 0; // last line not finished
+// search for beginning of the last line
+for (i=len-2;(i>0) && (buf[i-1] != '\n');i--);
+llen=len-2-i;
+if ((llen == 2) && (strncmp(buf+i,"OK",2) == 0)) return 1;
+if ((llen >= 5) && (strncmp(buf+i,"ERROR",5) == 0)) return 1;
+if ((llen >= 10) && (strncmp(buf+i,"+CME ERROR",10) == 0)) return 1;
+return 0;
+}
+
 //*************************************************
 //*  CRC-16 calculation 
 //*************************************************
@@ -125,32 +187,185 @@ printf("\n! Incorrect flash monitor version - [%i]%s\n",res,replybuf+2);
 return -1;
 }
   
+//----------------------------------------------------
+//  Firmware file split mode
+//----------------------------------------------------
+
+// output files written at the same time
+#define split_threads 4
+
+static uint32_t split_sflag;
+static int* split_res;   // 0 - ok, 1 - file not created, 2 - write error
+static volatile int32_t split_next;
+
+#ifndef WIN32
+#define split_inc() __sync_fetch_and_add(&split_next,1)
+#else
+#define split_inc() (InterlockedIncrement((LONG volatile*)&split_next)-1)
+#endif
+
+#ifndef WIN32
+//****************************************************
+//* Write the whole buffer
+//****************************************************
+static int write_all(int fd, void* buf, uint32_t len) {
+
+uint8_t* p=buf;
+int res;
+
+while (len>0) {
+  res=write(fd,p,len);
+  if (res <= 0) return 0;
+  p+=res;
+  len-=res;
+}
+return 1;
+}
+
+//****************************************************
+//* Copy the partition image from the firmware file
+//*
+//* The kernel copies the data (or shares the blocks on
+//* filesystems with reflinks), nothing passes through
+//* the user space.
+//*
+//* returns bytes copied, the rest is written from memory
+//****************************************************
+static uint32_t copy_image(int part, int out) {
+
+int in;
+loff_t off;
+ssize_t res;
+uint32_t done=0;
+
+if ((ptable[part].fname == 0) || (ptable[part].doffset == 0)) return 0;
+in=open(ptable[part].fname,O_RDONLY);
+if (in == -1) return 0;
+off=ptable[part].doffset;
+while (done<ptable[part].hd.psize) {
+  res=copy_file_range(in,&off,out,0,ptable[part].hd.psize-done,0);
+  if (res <= 0) break;  // not supported for these files - write from memory
+  done+=res;
+}
+close(in);
+return done;
+}
+#endif
+
+//****************************************************
+//* Write one partition file
+//****************************************************
+static int split_part(int i) {
+
+char filename[200];
+uint32_t done;
+#ifndef WIN32
+int out;
+#else
+FILE* out;
+#endif
+
+sprintf(filename,"%02i-%08x-%s.%s",i,ptable[i].hd.code,ptable[i].pname,(split_sflag?"fw":"bin"));
+#ifndef WIN32
+out=open(filename,O_WRONLY|O_CREAT|O_TRUNC,0644);
+if (out == -1) return 1;
+if (split_sflag) {
+  // header and checksum block
+  if (!write_all(out,&ptable[i].hd,sizeof(struct pheader)) ||
+      !write_all(out,ptable[i].csumblock,ptable[i].hd.hdsize-sizeof(struct pheader))) {
+    close(out);
+    return 2;
+  }
+}
+// body
+done=copy_image(i,out);
+if (!write_all(out,ptable[i].pimage+done,ptable[i].hd.psize-done)) {
+  close(out);
+  return 2;
+}
+if (close(out) != 0) return 2;
+#else
+out=fopen(filename,"wb");
+if (out == 0) return 1;
+if (split_sflag) {
+  // write header
+  fwrite(&ptable[i].hd,1,sizeof(struct pheader),out);   // fixed header
+  fwrite((void*)ptable[i].csumblock,1,ptable[i].hd.hdsize-sizeof(struct pheader),out); // checksum block
+}
+// write body
+done=fwrite(ptable[i].pimage,1,ptable[i].hd.psize,out);
+if ((fclose(out) != 0) || (done != ptable[i].hd.psize)) return 2;
+#endif
+return 0;
+}
+
+//****************************************************
+//* Split worker
+//****************************************************
+#ifndef WIN32
+static void* split_worker(void* arg) {
+#else
+static DWORD WINAPI split_worker(LPVOID arg) {
+#endif
+
+int i;
+
+while ((i=split_inc()) < npart) split_res[i]=split_part(i);
+return 0;
+}
+
 //****************************************************
 //*------- Firmware file split mode
+//*
+//* Partition files are written by a pool of workers.
 //****************************************************
 void fwsplit(uint32_t sflag) {
  
-uint32_t i;
-FILE* out;
-uint8_t filename[200];
+int i,nt,res=0;
+#ifndef WIN32
+pthread_t th[split_threads];
+#else
+HANDLE th[split_threads];
+#endif
 
 printf("\n Extracting partitions from firmware file:\n\n ## Offset    Size     Name\n-------------------------------------");
 for (i=0;i<npart;i++) {  
    printf("\n %02i %08x %8i  %s",i,ptable[i].offset,ptable[i].hd.psize,ptable[i].pname); 
-   // form file name
-   sprintf(filename,"%02i-%08x-%s.%s",i,ptable[i].hd.code,ptable[i].pname,(sflag?"fw":"bin"));
-   out=fopen(filename,"wb");
-   
-   if(sflag) {
-     // write header
-     fwrite(&ptable[i].hd,1,sizeof(struct pheader),out);   // fixed header
-     fwrite((void*)ptable[i].csumblock,1,ptable[i].hd.hdsize-sizeof(struct pheader),out); // checksum block
-   }
-   // write body
-   fwrite(ptable[i].pimage,ptable[i].hd.psize,1,out);
-   fclose(out);
 }
+fflush(stdout);
+
+split_sflag=sflag;
+split_res=calloc(npart,sizeof(int));
+split_next=0;
+nt=(npart<split_threads)?npart:split_threads;
+for (i=0;i<nt;i++) {
+#ifndef WIN32
+  if (pthread_create(&th[i],0,split_worker,0) != 0) break;
+#else
+  th[i]=CreateThread(0,0,split_worker,0,0,0);
+  if (th[i] == 0) break;
+#endif
+}
+nt=i;
+// the partitions left are written here
+split_worker(0);
+for (i=0;i<nt;i++) {
+#ifndef WIN32
+  pthread_join(th[i],0);
+#else
+  WaitForSingleObject(th[i],INFINITE);
+  CloseHandle(th[i]);
+#endif
+}
+
+for (i=0;i<npart;i++) {
+  if (split_res[i] == 1) printf("\n! Partition %02i (%s): output file cannot be created",i,ptable[i].pname);
+  if (split_res[i] == 2) printf("\n! Partition %02i (%s): output file write error",i,ptable[i].pname);
+  if (split_res[i] != 0) res=1;
+}
+free(split_res);
 printf("\n");
+if (res) exit(1);
 return;
 }
 
@@ -163,9 +378,7 @@ void enter_hdlc() {
 
 uint32_t res;  
 unsigned char OKrsp[]={0x0d, 0x0a, 0x4f, 0x4b, 0x0d, 0x0a};
-uint8_t replybuf[100]; 
-
-usleep(100000);
+uint8_t replybuf[200]; 
 
 res=atcmd("^DATAMODE",replybuf);
 if (res != 6) {
@@ -224,7 +437,7 @@ printf("\n Protocol version: %s",replybuf+2);
 void restart_modem() {
 
 unsigned char cmd_reset[7]={0xa};           // HDLC exit command
-uint8_t replybuf[100]; 
+uint8_t replybuf[200]; 
 
 printf("\n Restarting modem...\n");
 send_cmd(cmd_reset,1,replybuf);
@@ -234,14 +447,40 @@ atcmd("^RESET",replybuf);
 //****************************************************
 //* Get device identifier
 //****************************************************
+
+// device identifier from the last 0x45 command, spaces replaced with '_'
+char dev_id[100]={0};
+
+// serial number of the connected unit, empty - unknown
+char unit_id[100]={0};
+
+//****************************************************
+//* Extract device identifier from 0x45 command reply
+//****************************************************
+void reply_ident(uint8_t* replybuf, uint32_t iolen, char* id, int idlen) {
+
+uint32_t i;
+
+// keep printable part of the reply as device key
+for (i=0;(i+2<iolen) && (i<idlen-1);i++) {
+  if ((replybuf[i+2]<0x20) || (replybuf[i+2]>0x7e)) break;
+  id[i]=(replybuf[i+2] == ' ')?'_':replybuf[i+2];
+}
+id[i]=0;
+}
+
 void dev_ident() {
   
 uint8_t replybuf[100]; 
 uint32_t iolen;
 unsigned char cmd_getproduct[30]={0x45};
 
+dev_id[0]=0;
 iolen=send_cmd(cmd_getproduct,1,replybuf);
-if (iolen>2) printf("\n Device identifier: %s",replybuf+2); 
+if (iolen>2) {
+  printf("\n Device identifier: %s",replybuf+2); 
+  reply_ident(replybuf,iolen,dev_id,sizeof(dev_id));
+}  
 }
 
 
@@ -280,16 +519,16 @@ for (i=0;i<npart;i++) {
 //****************************************************
 //* Display firmware file information
 //****************************************************
-void show_fw_info() {
+void show_fw_info(int n) {
 
 uint8_t* sptr; 
 char ver[36];
   
-if (ptable[0].hd.version[0] != ':') printf("\n Firmware version: %s",ptable[0].hd.version); // non-standard version string
+if (ptable[n].hd.version[0] != ':') printf("\n Firmware version: %s",ptable[n].hd.version); // non-standard version string
 else {
   // standard version string
   memset(ver,0,sizeof(ver));  
-  strncpy(ver,ptable[0].hd.version,32);  
+  strncpy(ver,ptable[n].hd.version,32);  
   sptr=strrchr(ver+1,':'); // search for colon separator
   if (sptr == 0) printf("\n Firmware version: %s",ver); // not found - standard mismatch
   else {
@@ -299,8 +538,8 @@ else {
   }
 }  
   
-printf("\n Build date:       %s %s",ptable[0].hd.date,ptable[0].hd.time);
-printf("\n Header: version %i, compatibility code: %8.8s",ptable[0].hd.hdversion,ptable[0].hd.unlock);
+printf("\n Build date:       %s %s",ptable[n].hd.date,ptable[n].hd.time);
+printf("\n Header: version %i, compatibility code: %8.8s",ptable[n].hd.hdversion,ptable[n].hd.unlock);
 }
 
 
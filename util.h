@@ -1,5 +1,8 @@
 #include <stdint.h>
 void dump(char buffer[],int len,long base);
+uint64_t now_us();
+void json_string(FILE* out, char* str);
+int at_done(char* buf, int len);
 unsigned short crc16(char* buf, int len);
 int dloadversion();
 void fwsplit(uint32_t sflag);
@@ -8,6 +11,9 @@ void protocol_version();
 void leave_hdlc();
 void restart_modem();
 void dev_ident();
+extern char dev_id[100];
+extern char unit_id[100];
+void reply_ident(uint8_t* replybuf, uint32_t iolen, char* id, int idlen);
 void show_file_map();
-void show_fw_info();
+void show_fw_info(int n);
 